@@ -17,10 +17,49 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #ifndef BUFSIZE
 #define BUFSIZE 512*64
 #endif
 
+#ifndef RING_DEPTH
+#define RING_DEPTH 4
+#endif
+
+#ifndef DIRECT_ALIGN
+#define DIRECT_ALIGN 4096
+#endif
+
+#ifndef DROP_STRIDE
+#define DROP_STRIDE (8ULL << 20)
+#endif
+
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (64ULL << 20)
+#endif
+
+#ifndef ALIGN_PROBE
+#define ALIGN_PROBE (64 << 10)
+#endif
+
+#ifndef PATTERN_TILE
+#define PATTERN_TILE (16 << 10)
+#endif
+
+#ifndef BATCH_GROUP
+#define BATCH_GROUP 32
+#endif
+
+#ifndef LFSR_PROBE
+#define LFSR_PROBE (64 << 10)
+#endif
+
+/* Exit status, as with cmp: no differences, or none over the -t and -T
+   limits, is EXIT_SUCCESS */
+#define EXIT_DIFFER 1
+#define EXIT_TROUBLE 2
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,199 +67,6048 @@
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
-#include <smmintrin.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/io_uring.h>
+#include <immintrin.h>
+
+struct profile;
+struct range_list;
+struct mask_cursor;
+struct lfsr_gen;
+
+/* Diffcount result */
+struct diffcount_res {
+	unsigned long long comp_B;   /* Total number of bytes compared */
+	unsigned long long comp_b;   /* Total number of bits compared */
+	unsigned long long diff_B;   /* Number of different bytes */
+	unsigned long long diff_b;   /* Number of different bits */
+	unsigned long long flip_01;  /* Bits 0 in file 1 and 1 in file 2 */
+	unsigned long long flip_10;  /* Bits 1 in file 1 and 0 in file 2 */
+	unsigned long long meta_B;   /* Bytes compared without reading */
+	unsigned long long mask_b;   /* Bits set in the mask, with -m or -M */
+	double t_total;              /* Seconds spent in diffcount() */
+	double t_kernel;             /* Seconds spent in the compare kernel */
+	struct profile *prof;        /* Per-window counts, or NULL */
+	unsigned long long lane_b[64]; /* Differing bits by position in a
+	                                  64-bit word, with -L */
+	unsigned long long *cw_hist; /* Codewords by differing bits, with -E */
+	unsigned long long cw_weight; /* Differing bits so far in the last,
+	                                 incomplete codeword */
+	struct range_list *rl;       /* Differing ranges, or NULL */
+	unsigned long long n_ranges; /* Differing ranges listed, with -l */
+	int stopped;                 /* Stopped early at a -t or -T limit */
+	unsigned long long samples;  /* Blocks sampled with -s, or zero */
+	unsigned long long sample_of; /* Bytes the samples were taken from */
+	double est_B, err_B;         /* Estimated byte and bit fractions, */
+	double est_b, err_b;         /* with 95% interval half-widths */
+	const int *stop;             /* Set when another thread stopped the
+	                                compare, or NULL */
+	struct mask_cursor *mask;    /* Mask being read, or NULL */
+	struct lfsr_gen *lfsr;       /* LFSR reference, or NULL */
+};
+
+#define VOTE_MAX 15                  /* Most inputs to vote between */
+#define VOTE_PLANES 4                /* Bits of a vote count */
+
+/* N-way vote result */
+struct vote_res {
+	unsigned long long comp_B;   /* Bytes voted on */
+	unsigned long long any_B;    /* Bytes where any input disagrees */
+	unsigned long long any_b;    /* Bits where any input disagrees */
+	unsigned long long hist[VOTE_MAX/2 + 1]; /* Bits by the number of
+	                                            inputs outvoted */
+	unsigned long long copy_b[VOTE_MAX]; /* Bits of each input outvoted */
+	double t_total;              /* Seconds spent voting */
+	double t_kernel;             /* Seconds spent in the vote kernel */
+};
+
+/* Compare kernel. Adds the number of differing bytes and bits between
+   buf_1 and buf_2 over len bytes to dr->diff_B and dr->diff_b, and the
+   number of bits set in buf_1 and clear in buf_2 to dr->flip_10. */
+typedef void (*diff_kernel_fn)(const uint8_t *buf_1, const uint8_t *buf_2,
+                               size_t len, struct diffcount_res *dr);
+
+/* Constant compare kernel. As diff_kernel_fn, but comparing buf against
+   the byte const_val. */
+typedef void (*diff_const_fn)(const uint8_t *buf, size_t len,
+                              uint8_t const_val, struct diffcount_res *dr);
+
+/* Masked compare kernel. As diff_kernel_fn, but counting only the bits set
+   in the len bytes of mask, against buf_2 or, when that is NULL, const_val.
+   Adds the number of bits set in mask to dr->mask_b. */
+typedef void (*diff_mask_fn)(const uint8_t *buf_1, const uint8_t *buf_2,
+                             const uint8_t *mask, uint8_t const_val,
+                             size_t len, struct diffcount_res *dr);
+
+/* Positional popcount. Adds the differing bits of buf_1 against buf_2, or
+   against const_val when buf_2 is NULL, to lanes[8*b + k] for bit k of
+   bytes b mod 8. */
+typedef void (*diff_lanes_fn)(const uint8_t *buf_1, const uint8_t *buf_2,
+                              uint8_t const_val, size_t len,
+                              unsigned long long *lanes);
+
+/* Stores the number of differing bits of each of the n 64-bit words of
+   buf_1 against buf_2, or against const_val when buf_2 is NULL, in w */
+typedef void (*diff_words_fn)(const uint8_t *buf_1, const uint8_t *buf_2,
+                              uint8_t const_val, size_t n, uint64_t *w);
+
+/* Sets bit j of m[k] when byte 64*k + j of the len bytes of buf_1 differs
+   from buf_2, or from const_val when buf_2 is NULL */
+typedef void (*diff_masks_fn)(const uint8_t *buf_1, const uint8_t *buf_2,
+                              uint8_t const_val, size_t len, uint64_t *m);
+
+/* Stores in out the len bytes of the bit stream that starts k bits, 1 to 7,
+   into buf, most significant bit first. Reads len + 1 bytes of buf. */
+typedef void (*diff_shift_fn)(const uint8_t *buf, unsigned k, size_t len,
+                              uint8_t *out);
+
+/* Vote kernel. Takes the majority of each bit over the n blocks bufs of
+   len bytes, and stores it in out unless that is NULL. With an even n,
+   ties go to the first block. Adds the bits and bytes where any block
+   disagrees, the bits by how many blocks the majority outvotes, and the
+   bits each block is outvoted on to vr. */
+typedef void (*diff_vote_fn)(const uint8_t *const *bufs, unsigned n,
+                             size_t len, uint8_t *out, struct vote_res *vr);
+
+struct diff_kernel {
+	const char *name;
+	diff_kernel_fn fn;
+	diff_const_fn const_fn;
+	diff_mask_fn mask_fn;
+	diff_lanes_fn lanes_fn;
+	diff_words_fn words_fn;
+	diff_masks_fn masks_fn;
+	diff_shift_fn shift_fn;
+	diff_vote_fn vote_fn;
+	int (*supported)(void);  /* Nonzero if usable on this CPU */
+};
+
+struct diffcount_ctl;
+
+/* Input engine. Delivers successive pairs of equal-length blocks read from
+   the two inputs. */
+struct diff_engine {
+	const char *name;
+	/* Nonzero if the engine can handle the inputs in dc */
+	int (*usable)(const struct diffcount_ctl *dc);
+	/* Start reading len bytes (zero for up to the first EOF) at off_1
+	   and off_2. Returns the engine state. */
+	void *(*open)(const struct diffcount_ctl *dc,
+	              unsigned long long off_1, unsigned long long off_2,
+	              unsigned long long len);
+	/* Point p1 and p2 at the next pair of blocks and return their
+	   length, or zero when done. Blocks stay valid until the next
+	   call. In constant mode p2 is not used. */
+	size_t (*next)(void *state, const uint8_t **p1, const uint8_t **p2);
+	void (*close)(void *state);
+	/* Engine to use instead when this one is explicitly selected but
+	   not usable, or NULL */
+	const char *fallback;
+};
 
 typedef enum {
 	CMP_FILE, /* Compare to another file */
 	CMP_CONST /* Compare to a constant byte */
 } cmp_mode_t;
 
-/* Diffcount control */
-struct diffcount_ctl {
-	char *fname_1;
-	char *fname_2;
-	unsigned long long seek_1;   /* Seek value for file 1 */
-	unsigned long long seek_2;   /* Seek value for file 2 */
-	unsigned long long max_len;  /* Maximum number of bytes to compare.
-	                                Go to first EOF if zero. */
-	cmp_mode_t cmp_mode;
-	uint8_t const_val; /* Constant byte value */
+/* Reference generated in constant mode */
+typedef enum {
+	REF_BYTE,    /* The byte const_val */
+	REF_PATTERN, /* A repeating pattern of bytes */
+	REF_COUNT,   /* Each word holds its index */
+	REF_ADDR,    /* Each word holds its offset */
+	REF_LFSR     /* An LFSR sequence, such as a PRBS */
+} ref_kind_t;
+
+/* Diffcount control */
+#define NO_LIMIT (~0ULL)
+
+struct diffcount_ctl {
+	char *fname_1;
+	char *fname_2;
+	char **fnames;     /* All the inputs, with -N */
+	unsigned nfiles;
+	const char *vote_fname; /* Majority output, with -V, or NULL */
+	const char *batch_fname; /* Target list, with -B, or NULL */
+	unsigned long long seek_1;   /* Seek value for file 1 */
+	unsigned long long seek_2;   /* Seek value for file 2 */
+	unsigned bit_1;    /* Bits past seek1 that file 1 starts at, */
+	unsigned bit_2;    /* and past seek2 for file 2, MSB first */
+	unsigned long long max_len;  /* Maximum number of bytes to compare.
+	                                Go to first EOF if zero. */
+	cmp_mode_t cmp_mode;
+	uint8_t const_val; /* Constant byte value */
+	ref_kind_t ref;    /* What constant mode compares against */
+	const uint8_t *ref_pat; /* Reference pattern, from tile_pattern() */
+	size_t ref_period; /* Length of the reference pattern */
+	unsigned ref_width; /* Bytes per word of a generated reference */
+	const char *lfsr_name; /* Name of a standard PRBS, or NULL */
+	uint64_t lfsr_taps; /* Bit k - 1 set for each term x^k */
+	unsigned lfsr_len; /* Register length, the degree of the polynomial */
+	uint64_t lfsr_seed; /* Register before the first bit */
+	int lfsr_sync;     /* Seed the register from file 1 */
+	int lfsr_inv;      /* Invert the sequence */
+	const struct diff_kernel *kernel;
+	const struct diff_engine *engine;
+	size_t bufsize;    /* Size of each read buffer */
+	unsigned ring_depth; /* Number of buffer pairs in flight. One reads
+	                        synchronously, more use a reader thread.
+	                        Zero picks a default. */
+	unsigned jobs;     /* Number of compare threads */
+	int direct;        /* Bypass the page cache */
+	size_t align;      /* Alignment for direct I/O */
+	unsigned long long readahead; /* Block device readahead to use, in
+	                                 bytes, or zero to leave it alone */
+	int sparse;        /* Skip holes in sparse files */
+	int shared;        /* Skip extents shared between the files */
+	int verbose;       /* Report kernel and timing statistics */
+	unsigned long long window; /* Profile window size, zero for none */
+	const char *prof_fname; /* Profile output file, "-" for stdout */
+	int prof_binary;   /* Write the profile as binary records */
+	unsigned lane_width; /* Word size in bits for the bit position
+	                        histogram, zero for none */
+	unsigned cw_bits;  /* Codeword size in bits for the error weight
+	                      histogram, zero for none */
+	int cw_t;          /* Correctable bits per codeword, or -1 */
+	const char *range_fname; /* Differing range list, "-" for stdout,
+	                            or NULL */
+	unsigned long long range_gap; /* Merge ranges this close */
+	unsigned long long limit_B; /* Stop once more bytes than this differ, */
+	unsigned long long limit_b; /* or more bits, NO_LIMIT for none */
+	int size_differ;   /* Inputs of different sizes differ, with -x */
+	unsigned long long sample_B; /* Bytes to sample, zero for none */
+	double sample_err; /* Sample until the 95% intervals are this
+	                      narrow, zero for none */
+	int lag_search;    /* Search for the best lag first, with -A */
+	long long lag_min; /* Lags to search, file 2 against file 1 */
+	long long lag_max;
+	size_t probe;      /* Bytes of file 1 to score each lag on */
+	const char *mask_fname; /* Mask file, read at the offsets of file 1,
+	                           or NULL */
+	const uint8_t *mask_pat; /* Mask pattern, from tile_pattern(), or
+	                            NULL */
+	size_t mask_period; /* Length of the mask pattern */
+};
+
+static void *malloc_or_die(size_t size)
+{
+	void *buf;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_TROUBLE);
+	}
+	return buf;
+}
+
+/*
+ * Compare kernels
+ *
+ * Each kernel is compiled for its own target with the GCC target attribute,
+ * so a single binary carries all of them and picks one at startup based
+ * on what the CPU reports.
+ *
+ * Kernels are written once as an always-inline body taking either a second
+ * buffer or, when that is NULL, a constant byte. DEFINE_KERNEL() expands a
+ * body into the two-buffer kernel and the constant kernel. The constant
+ * kernel has copies specialized for 0x00 and 0xff, and in all of them the
+ * constant is broadcast into a register rather than read from memory.
+ */
+
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+#define DEFINE_KERNEL(name, attr)                                       \
+attr static void name(const uint8_t *buf_1, const uint8_t *buf_2,      \
+                      size_t len, struct diffcount_res *dr)             \
+{                                                                       \
+	name##_body(buf_1, buf_2, 0, len, dr);                          \
+}                                                                       \
+attr static void name##_const(const uint8_t *buf, size_t len,          \
+                              uint8_t const_val,                        \
+                              struct diffcount_res *dr)                 \
+{                                                                       \
+	if (const_val == 0x00)                                          \
+		name##_body(buf, NULL, 0x00, len, dr);                  \
+	else if (const_val == 0xff)                                     \
+		name##_body(buf, NULL, 0xff, len, dr);                  \
+	else                                                            \
+		name##_body(buf, NULL, const_val, len, dr);             \
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Set the high bit of each nonzero byte of x, and clear everything else */
+static inline uint64_t nonzero_bytes(uint64_t x)
+{
+	const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+
+	return (((x & lo7) + lo7) | x) & ~lo7;
+}
+
+KERNEL_BODY
+void diff_scalar_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                      size_t len, struct diffcount_res *dr)
+{
+	const uint64_t pattern = c*0x0101010101010101ULL;
+	unsigned long long diff_B = 0, diff_b = 0, flip_10 = 0;
+	uint64_t quad_1, quad_2, quad_xor;
+	uint8_t byte_1, byte_2;
+	size_t i = 0;
+
+	/* Process 8 bytes at a time */
+	for (; i + 8 <= len; i += 8) {
+		quad_1 = load64(buf_1 + i);
+		quad_2 = buf_2 ? load64(buf_2 + i) : pattern;
+		quad_xor = quad_1 ^ quad_2;
+		diff_B += __builtin_popcountll(nonzero_bytes(quad_xor));
+		diff_b += __builtin_popcountll(quad_xor);
+		flip_10 += __builtin_popcountll(quad_1 & ~quad_2);
+	}
+	/* Clean up any remaining bytes */
+	for (; i < len; i++) {
+		byte_1 = buf_1[i];
+		byte_2 = buf_2 ? buf_2[i] : c;
+		diff_B += byte_1 != byte_2;
+		diff_b += __builtin_popcount(byte_1 ^ byte_2);
+		flip_10 += __builtin_popcount(byte_1 & ~byte_2 & 0xff);
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += diff_b;
+	dr->flip_10 += flip_10;
+}
+
+#define diff_generic_body diff_scalar_body
+#define diff_popcnt_body diff_scalar_body
+
+DEFINE_KERNEL(diff_generic, )
+DEFINE_KERNEL(diff_popcnt, __attribute__((target("popcnt"))))
+
+/* Per-byte popcount of a 256-bit vector, using a nibble lookup table */
+__attribute__((target("avx2")))
+static inline __m256i popcnt8_avx2(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i lo, hi;
+
+	lo = _mm256_and_si256(v, low_mask);
+	hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+	                       _mm256_shuffle_epi8(lookup, hi));
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t hsum64_avx2(__m256i v)
+{
+	return (uint64_t)_mm256_extract_epi64(v, 0) +
+	       (uint64_t)_mm256_extract_epi64(v, 1) +
+	       (uint64_t)_mm256_extract_epi64(v, 2) +
+	       (uint64_t)_mm256_extract_epi64(v, 3);
+}
+
+/* XOR of 32 bytes of buf_1 with buf_2, or with the constant c */
+__attribute__((target("avx2")))
+static inline __m256i load_xor_avx2(const uint8_t *buf_1, const uint8_t *buf_2,
+                                    uint8_t c, size_t i)
+{
+	return _mm256_xor_si256(
+		_mm256_loadu_si256((const __m256i *)(buf_1 + i)),
+		buf_2 ? _mm256_loadu_si256((const __m256i *)(buf_2 + i)) :
+		        _mm256_set1_epi8(c));
+}
+
+/* Bits set in 32 bytes of buf_1 and clear in buf_2, or in the constant c */
+__attribute__((target("avx2")))
+static inline __m256i load_clr_avx2(const uint8_t *buf_1, const uint8_t *buf_2,
+                                    uint8_t c, size_t i)
+{
+	return _mm256_andnot_si256(
+		buf_2 ? _mm256_loadu_si256((const __m256i *)(buf_2 + i)) :
+		        _mm256_set1_epi8(c),
+		_mm256_loadu_si256((const __m256i *)(buf_1 + i)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcnt64_avx2(__m256i v)
+{
+	return _mm256_sad_epu8(popcnt8_avx2(v), _mm256_setzero_si256());
+}
+
+/* Finish the bytes after a vector loop with the scalar kernel */
+#define KERNEL_TAIL(kernel, buf_1, buf_2, c, i, len, dr) do {           \
+	if (buf_2)                                                      \
+		kernel(buf_1 + i, buf_2 + i, len - i, dr);              \
+	else                                                            \
+		kernel##_const(buf_1 + i, len - i, c, dr);              \
+} while (0)
+
+/* 32 bytes per step. Differing bytes are counted from a compare-to-zero
+   mask, and differing and flipped bits with a nibble lookup summed by
+   vpsadbw. */
+KERNEL_BODY __attribute__((target("avx2,popcnt")))
+void diff_avx2_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                    size_t len, struct diffcount_res *dr)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i x, acc = zero, acc_10 = zero;
+	unsigned long long diff_B = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		x = load_xor_avx2(buf_1, buf_2, c, i);
+		diff_B += 32 - _mm_popcnt_u32(_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(x, zero)));
+		acc = _mm256_add_epi64(acc, popcnt64_avx2(x));
+		acc_10 = _mm256_add_epi64(acc_10,
+			popcnt64_avx2(load_clr_avx2(buf_1, buf_2, c, i)));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += hsum64_avx2(acc);
+	dr->flip_10 += hsum64_avx2(acc_10);
+	KERNEL_TAIL(diff_popcnt, buf_1, buf_2, c, i, len, dr);
+}
+
+DEFINE_KERNEL(diff_avx2, __attribute__((target("avx2,popcnt"))))
+
+/* XOR of the bytes of buf_1 under mask m with buf_2, or with the constant
+   c. Bytes outside the mask are zero. */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load_xor_avx512(const uint8_t *buf_1,
+                                      const uint8_t *buf_2, uint8_t c,
+                                      size_t i, __mmask64 m)
+{
+	return _mm512_xor_si512(_mm512_maskz_loadu_epi8(m, buf_1 + i),
+		buf_2 ? _mm512_maskz_loadu_epi8(m, buf_2 + i) :
+		        _mm512_maskz_mov_epi8(m, _mm512_set1_epi8(c)));
+}
+
+/* Bits set in the bytes of buf_1 under mask m and clear in buf_2, or in
+   the constant c */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load_clr_avx512(const uint8_t *buf_1,
+                                      const uint8_t *buf_2, uint8_t c,
+                                      size_t i, __mmask64 m)
+{
+	return _mm512_andnot_si512(
+		buf_2 ? _mm512_maskz_loadu_epi8(m, buf_2 + i) :
+		        _mm512_set1_epi8(c),
+		_mm512_maskz_loadu_epi8(m, buf_1 + i));
+}
+
+/* Per-qword popcount of a 512-bit vector, using a nibble lookup table
+   summed by vpsadbw */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i popcnt64_avx512bw(__m512i v)
+{
+	const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+	const __m512i low_mask = _mm512_set1_epi8(0x0f);
+	__m512i lo, hi;
+
+	lo = _mm512_and_si512(v, low_mask);
+	hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+	return _mm512_sad_epu8(_mm512_add_epi8(_mm512_shuffle_epi8(lookup, lo),
+	                                       _mm512_shuffle_epi8(lookup, hi)),
+	                       _mm512_setzero_si512());
+}
+
+/* Load mask for the bytes from i up to len, at most 64 */
+static inline __mmask64 tail_mask(size_t i, size_t len)
+{
+	return (len - i >= 64) ? ~(__mmask64)0 :
+	       ((__mmask64)1 << (len - i)) - 1;
+}
+
+/* 64 bytes per step, with the tail handled by a masked load. Differing
+   bytes are counted from a test mask, and differing and flipped bits with
+   a nibble lookup summed by vpsadbw. */
+KERNEL_BODY __attribute__((target("avx512f,avx512bw,popcnt")))
+void diff_avx512bw_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                        uint8_t c, size_t len, struct diffcount_res *dr)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i x, acc = zero, acc_10 = zero;
+	unsigned long long diff_B = 0;
+	__mmask64 m;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		m = tail_mask(i, len);
+		x = load_xor_avx512(buf_1, buf_2, c, i, m);
+		diff_B += _mm_popcnt_u64(_mm512_test_epi8_mask(x, x));
+		acc = _mm512_add_epi64(acc, popcnt64_avx512bw(x));
+		acc_10 = _mm512_add_epi64(acc_10, popcnt64_avx512bw(
+			load_clr_avx512(buf_1, buf_2, c, i, m)));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += _mm512_reduce_add_epi64(acc);
+	dr->flip_10 += _mm512_reduce_add_epi64(acc_10);
+}
+
+DEFINE_KERNEL(diff_avx512bw, __attribute__((target("avx512f,avx512bw,popcnt"))))
+
+/* As diff_avx512bw, but counting bits with VPOPCNTQ */
+KERNEL_BODY
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt")))
+void diff_avx512vpopcntdq_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                               uint8_t c, size_t len,
+                               struct diffcount_res *dr)
+{
+	__m512i x, acc = _mm512_setzero_si512(), acc_10 = acc;
+	unsigned long long diff_B = 0;
+	__mmask64 m;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		m = tail_mask(i, len);
+		x = load_xor_avx512(buf_1, buf_2, c, i, m);
+		diff_B += _mm_popcnt_u64(_mm512_test_epi8_mask(x, x));
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+		acc_10 = _mm512_add_epi64(acc_10, _mm512_popcnt_epi64(
+			load_clr_avx512(buf_1, buf_2, c, i, m)));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += _mm512_reduce_add_epi64(acc);
+	dr->flip_10 += _mm512_reduce_add_epi64(acc_10);
+}
+
+DEFINE_KERNEL(diff_avx512vpopcntdq,
+              __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt"))))
+
+/*
+ * Harley-Seal kernels
+ *
+ * Carry-save adders fold 16 XOR vectors into ones/twos/fours/eights
+ * partial sums, so only one vector in 16 needs a full popcount (Mula,
+ * Kurz and Lemire, "Faster Population Counts Using AVX2 Instructions").
+ * Flipped bits get a second set of partial sums.
+ * Differing bytes are counted by summing compare masks bytewise and
+ * flushing them with vpsadbw once per block.
+ */
+
+#define CSA_AVX2(h, l, a, b, c) do {                                   \
+	__m256i a_ = (a), b_ = (b), c_ = (c);                          \
+	__m256i u_ = _mm256_xor_si256(a_, b_);                         \
+	h = _mm256_or_si256(_mm256_and_si256(a_, b_),                  \
+	                    _mm256_and_si256(u_, c_));                 \
+	l = _mm256_xor_si256(u_, c_);                                  \
+} while (0)
+
+__attribute__((target("avx2")))
+static inline __m256i xor_avx2(const uint8_t *buf_1, const uint8_t *buf_2,
+                               uint8_t c, size_t i, __m256i *eq)
+{
+	__m256i x;
+
+	x = load_xor_avx2(buf_1, buf_2, c, i);
+	*eq = _mm256_sub_epi8(*eq, _mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+	return x;
+}
+
+#define XOR_AVX2(i) xor_avx2(buf_1, buf_2, c, i, &eq)
+
+/* Fold the 8 XOR vectors at i, or with clr the vectors of bits set in
+   buf_1 and clear in the other, into ones, twos and fours, and return the
+   carry of weight 8 */
+__attribute__((target("avx2")))
+static inline __m256i csa8_avx2(const uint8_t *buf_1, const uint8_t *buf_2,
+                                uint8_t c, int clr, size_t i, __m256i *ones,
+                                __m256i *twos, __m256i *fours)
+{
+	__m256i twos_a, twos_b, fours_a, fours_b, eights;
+
+#define LOAD_AVX2(i) (clr ? load_clr_avx2(buf_1, buf_2, c, i) : \
+                        load_xor_avx2(buf_1, buf_2, c, i))
+	CSA_AVX2(twos_a, *ones, *ones, LOAD_AVX2(i), LOAD_AVX2(i + 32));
+	CSA_AVX2(twos_b, *ones, *ones, LOAD_AVX2(i + 64), LOAD_AVX2(i + 96));
+	CSA_AVX2(fours_a, *twos, *twos, twos_a, twos_b);
+	CSA_AVX2(twos_a, *ones, *ones, LOAD_AVX2(i + 128),
+	         LOAD_AVX2(i + 160));
+	CSA_AVX2(twos_b, *ones, *ones, LOAD_AVX2(i + 192),
+	         LOAD_AVX2(i + 224));
+	CSA_AVX2(fours_b, *twos, *twos, twos_a, twos_b);
+	CSA_AVX2(eights, *fours, *fours, fours_a, fours_b);
+#undef LOAD_AVX2
+	return eights;
+}
+
+/* Fold the 16 vectors at i as csa8_avx2() does, and also into eights, and
+   return the carry of weight 16 */
+__attribute__((target("avx2")))
+static inline __m256i csa16_avx2(const uint8_t *buf_1, const uint8_t *buf_2,
+                                 uint8_t c, int clr, size_t i, __m256i *ones,
+                                 __m256i *twos, __m256i *fours,
+                                 __m256i *eights)
+{
+	__m256i eights_a, eights_b, sixteens;
+
+	eights_a = csa8_avx2(buf_1, buf_2, c, clr, i, ones, twos, fours);
+	eights_b = csa8_avx2(buf_1, buf_2, c, clr, i + 8*32, ones, twos,
+	                     fours);
+	CSA_AVX2(sixteens, *eights, *eights, eights_a, eights_b);
+	return sixteens;
+}
+
+/* Total of the Harley-Seal sums, with sixteens already counted */
+__attribute__((target("avx2")))
+static inline uint64_t csa_total_avx2(__m256i sixteens, __m256i eights,
+                                      __m256i fours, __m256i twos,
+                                      __m256i ones)
+{
+	__m256i total;
+
+	total = _mm256_slli_epi64(sixteens, 4);
+	total = _mm256_add_epi64(total,
+		_mm256_slli_epi64(popcnt64_avx2(eights), 3));
+	total = _mm256_add_epi64(total,
+		_mm256_slli_epi64(popcnt64_avx2(fours), 2));
+	total = _mm256_add_epi64(total,
+		_mm256_slli_epi64(popcnt64_avx2(twos), 1));
+	total = _mm256_add_epi64(total, popcnt64_avx2(ones));
+	return hsum64_avx2(total);
+}
+
+
+KERNEL_BODY __attribute__((target("avx2,popcnt")))
+void diff_avx2_hs_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                       size_t len, struct diffcount_res *dr)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total = zero, ones = zero, twos = zero, fours = zero;
+	__m256i eights = zero, sixteens;
+	__m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+	__m256i eq, eq_total = zero;
+	__m256i ones_10 = zero, twos_10 = zero, fours_10 = zero;
+	__m256i eights_10 = zero, total_10 = zero;
+	unsigned long long equal_B = 0;
+	size_t i = 0;
+
+	for (; i + 16*32 <= len; i += 16*32) {
+		eq = zero;
+		CSA_AVX2(twos_a, ones, ones, XOR_AVX2(i), XOR_AVX2(i + 32));
+		CSA_AVX2(twos_b, ones, ones, XOR_AVX2(i + 64), XOR_AVX2(i + 96));
+		CSA_AVX2(fours_a, twos, twos, twos_a, twos_b);
+		CSA_AVX2(twos_a, ones, ones, XOR_AVX2(i + 128),
+		         XOR_AVX2(i + 160));
+		CSA_AVX2(twos_b, ones, ones, XOR_AVX2(i + 192),
+		         XOR_AVX2(i + 224));
+		CSA_AVX2(fours_b, twos, twos, twos_a, twos_b);
+		CSA_AVX2(eights_a, fours, fours, fours_a, fours_b);
+		CSA_AVX2(twos_a, ones, ones, XOR_AVX2(i + 256),
+		         XOR_AVX2(i + 288));
+		CSA_AVX2(twos_b, ones, ones, XOR_AVX2(i + 320),
+		         XOR_AVX2(i + 352));
+		CSA_AVX2(fours_a, twos, twos, twos_a, twos_b);
+		CSA_AVX2(twos_a, ones, ones, XOR_AVX2(i + 384),
+		         XOR_AVX2(i + 416));
+		CSA_AVX2(twos_b, ones, ones, XOR_AVX2(i + 448),
+		         XOR_AVX2(i + 480));
+		CSA_AVX2(fours_b, twos, twos, twos_a, twos_b);
+		CSA_AVX2(eights_b, fours, fours, fours_a, fours_b);
+		CSA_AVX2(sixteens, eights, eights, eights_a, eights_b);
+
+		total = _mm256_add_epi64(total, popcnt64_avx2(sixteens));
+		eq_total = _mm256_add_epi64(eq_total, _mm256_sad_epu8(eq, zero));
+
+		sixteens = csa16_avx2(buf_1, buf_2, c, 1, i, &ones_10,
+		                      &twos_10, &fours_10, &eights_10);
+		total_10 = _mm256_add_epi64(total_10, popcnt64_avx2(sixteens));
+	}
+
+	equal_B = hsum64_avx2(eq_total);
+
+	dr->diff_B += i - equal_B;
+	dr->diff_b += csa_total_avx2(total, eights, fours, twos, ones);
+	dr->flip_10 += csa_total_avx2(total_10, eights_10, fours_10, twos_10,
+	                              ones_10);
+	KERNEL_TAIL(diff_avx2, buf_1, buf_2, c, i, len, dr);
+}
+
+DEFINE_KERNEL(diff_avx2_hs, __attribute__((target("avx2,popcnt"))))
+
+/* With AVX-512 each carry-save adder is a pair of vpternlogq */
+#define CSA_AVX512(h, l, a, b, c) do {                                 \
+	__m512i a_ = (a), b_ = (b), c_ = (c);                          \
+	h = _mm512_ternarylogic_epi64(a_, b_, c_, 0xe8);               \
+	l = _mm512_ternarylogic_epi64(a_, b_, c_, 0x96);               \
+} while (0)
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline __m512i xor_avx512(const uint8_t *buf_1, const uint8_t *buf_2,
+                                 uint8_t c, size_t i,
+                                 unsigned long long *diff_B)
+{
+	__m512i x;
+
+	x = load_xor_avx512(buf_1, buf_2, c, i, ~(__mmask64)0);
+	*diff_B += _mm_popcnt_u64(_mm512_test_epi8_mask(x, x));
+	return x;
+}
+
+#define XOR_AVX512(i) xor_avx512(buf_1, buf_2, c, i, &diff_B)
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i csa8_avx512(const uint8_t *buf_1, const uint8_t *buf_2,
+                                  uint8_t c, int clr, size_t i,
+                                  __m512i *ones, __m512i *twos,
+                                  __m512i *fours)
+{
+	const __mmask64 m = ~(__mmask64)0;
+	__m512i twos_a, twos_b, fours_a, fours_b, eights;
+
+#define LOAD_AVX512(i) (clr ? load_clr_avx512(buf_1, buf_2, c, i, m) : \
+                          load_xor_avx512(buf_1, buf_2, c, i, m))
+	CSA_AVX512(twos_a, *ones, *ones, LOAD_AVX512(i),
+	           LOAD_AVX512(i + 64));
+	CSA_AVX512(twos_b, *ones, *ones, LOAD_AVX512(i + 128),
+	           LOAD_AVX512(i + 192));
+	CSA_AVX512(fours_a, *twos, *twos, twos_a, twos_b);
+	CSA_AVX512(twos_a, *ones, *ones, LOAD_AVX512(i + 256),
+	           LOAD_AVX512(i + 320));
+	CSA_AVX512(twos_b, *ones, *ones, LOAD_AVX512(i + 384),
+	           LOAD_AVX512(i + 448));
+	CSA_AVX512(fours_b, *twos, *twos, twos_a, twos_b);
+	CSA_AVX512(eights, *fours, *fours, fours_a, fours_b);
+#undef LOAD_AVX512
+	return eights;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i csa16_avx512(const uint8_t *buf_1,
+                                   const uint8_t *buf_2, uint8_t c,
+                                   int clr, size_t i, __m512i *ones,
+                                   __m512i *twos,
+                                   __m512i *fours, __m512i *eights)
+{
+	__m512i eights_a, eights_b, sixteens;
+
+	eights_a = csa8_avx512(buf_1, buf_2, c, clr, i, ones, twos, fours);
+	eights_b = csa8_avx512(buf_1, buf_2, c, clr, i + 8*64, ones, twos,
+	                       fours);
+	CSA_AVX512(sixteens, *eights, *eights, eights_a, eights_b);
+	return sixteens;
+}
+
+/* Total of the Harley-Seal sums, with sixteens already counted */
+__attribute__((target("avx512f,avx512bw")))
+static inline uint64_t csa_total_avx512(__m512i sixteens, __m512i eights,
+                                        __m512i fours, __m512i twos,
+                                        __m512i ones)
+{
+	__m512i total;
+
+	total = _mm512_slli_epi64(sixteens, 4);
+	total = _mm512_add_epi64(total,
+		_mm512_slli_epi64(popcnt64_avx512bw(eights), 3));
+	total = _mm512_add_epi64(total,
+		_mm512_slli_epi64(popcnt64_avx512bw(fours), 2));
+	total = _mm512_add_epi64(total,
+		_mm512_slli_epi64(popcnt64_avx512bw(twos), 1));
+	total = _mm512_add_epi64(total, popcnt64_avx512bw(ones));
+	return _mm512_reduce_add_epi64(total);
+}
+
+
+KERNEL_BODY __attribute__((target("avx512f,avx512bw,popcnt")))
+void diff_avx512bw_hs_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                           uint8_t c, size_t len, struct diffcount_res *dr)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i total = zero, ones = zero, twos = zero, fours = zero;
+	__m512i eights = zero, sixteens;
+	__m512i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+	__m512i ones_10 = zero, twos_10 = zero, fours_10 = zero;
+	__m512i eights_10 = zero, total_10 = zero;
+	unsigned long long diff_B = 0;
+	size_t i = 0;
+
+	for (; i + 16*64 <= len; i += 16*64) {
+		CSA_AVX512(twos_a, ones, ones, XOR_AVX512(i),
+		           XOR_AVX512(i + 64));
+		CSA_AVX512(twos_b, ones, ones, XOR_AVX512(i + 128),
+		           XOR_AVX512(i + 192));
+		CSA_AVX512(fours_a, twos, twos, twos_a, twos_b);
+		CSA_AVX512(twos_a, ones, ones, XOR_AVX512(i + 256),
+		           XOR_AVX512(i + 320));
+		CSA_AVX512(twos_b, ones, ones, XOR_AVX512(i + 384),
+		           XOR_AVX512(i + 448));
+		CSA_AVX512(fours_b, twos, twos, twos_a, twos_b);
+		CSA_AVX512(eights_a, fours, fours, fours_a, fours_b);
+		CSA_AVX512(twos_a, ones, ones, XOR_AVX512(i + 512),
+		           XOR_AVX512(i + 576));
+		CSA_AVX512(twos_b, ones, ones, XOR_AVX512(i + 640),
+		           XOR_AVX512(i + 704));
+		CSA_AVX512(fours_a, twos, twos, twos_a, twos_b);
+		CSA_AVX512(twos_a, ones, ones, XOR_AVX512(i + 768),
+		           XOR_AVX512(i + 832));
+		CSA_AVX512(twos_b, ones, ones, XOR_AVX512(i + 896),
+		           XOR_AVX512(i + 960));
+		CSA_AVX512(fours_b, twos, twos, twos_a, twos_b);
+		CSA_AVX512(eights_b, fours, fours, fours_a, fours_b);
+		CSA_AVX512(sixteens, eights, eights, eights_a, eights_b);
+
+		total = _mm512_add_epi64(total, popcnt64_avx512bw(sixteens));
+
+		sixteens = csa16_avx512(buf_1, buf_2, c, 1, i, &ones_10,
+		                        &twos_10, &fours_10, &eights_10);
+		total_10 = _mm512_add_epi64(total_10,
+		                            popcnt64_avx512bw(sixteens));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += csa_total_avx512(total, eights, fours, twos, ones);
+	dr->flip_10 += csa_total_avx512(total_10, eights_10, fours_10,
+	                                twos_10, ones_10);
+	KERNEL_TAIL(diff_avx512bw, buf_1, buf_2, c, i, len, dr);
+}
+
+DEFINE_KERNEL(diff_avx512bw_hs, __attribute__((target("avx512f,avx512bw,popcnt"))))
+
+/*
+ * Masked kernels
+ *
+ * With -m or -M, the XOR of the inputs is ANDed with a mask before
+ * counting, so only the bits set in the mask are compared. The mask is
+ * read as a third stream in the same pass as the inputs, and the bits set
+ * in it are counted alongside, as the number of bits compared.
+ */
+
+#define DEFINE_MASKED(name, attr)                                       \
+attr static void name(const uint8_t *buf_1, const uint8_t *buf_2,      \
+                      const uint8_t *mask, uint8_t const_val,           \
+                      size_t len, struct diffcount_res *dr)             \
+{                                                                       \
+	if (buf_2 != NULL)                                              \
+		name##_body(buf_1, buf_2, mask, 0, len, dr);            \
+	else                                                            \
+		name##_body(buf_1, NULL, mask, const_val, len, dr);     \
+}
+
+KERNEL_BODY
+void mask_scalar_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                      const uint8_t *mask, uint8_t c, size_t len,
+                      struct diffcount_res *dr)
+{
+	const uint64_t pattern = c*0x0101010101010101ULL;
+	unsigned long long diff_B = 0, diff_b = 0, flip_10 = 0, mask_b = 0;
+	uint64_t quad_1, quad_2, quad_m, quad_xor;
+	uint8_t byte_1, byte_2, byte_m;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		quad_1 = load64(buf_1 + i);
+		quad_2 = buf_2 ? load64(buf_2 + i) : pattern;
+		quad_m = load64(mask + i);
+		quad_xor = (quad_1 ^ quad_2) & quad_m;
+		diff_B += __builtin_popcountll(nonzero_bytes(quad_xor));
+		diff_b += __builtin_popcountll(quad_xor);
+		flip_10 += __builtin_popcountll(quad_1 & ~quad_2 & quad_m);
+		mask_b += __builtin_popcountll(quad_m);
+	}
+	for (; i < len; i++) {
+		byte_1 = buf_1[i];
+		byte_2 = buf_2 ? buf_2[i] : c;
+		byte_m = mask[i];
+		diff_B += ((byte_1 ^ byte_2) & byte_m) != 0;
+		diff_b += __builtin_popcount((byte_1 ^ byte_2) & byte_m);
+		flip_10 += __builtin_popcount(byte_1 & ~byte_2 & byte_m);
+		mask_b += __builtin_popcount(byte_m);
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += diff_b;
+	dr->flip_10 += flip_10;
+	dr->mask_b += mask_b;
+}
+
+#define mask_generic_body mask_scalar_body
+#define mask_popcnt_body mask_scalar_body
+
+DEFINE_MASKED(mask_generic, )
+DEFINE_MASKED(mask_popcnt, __attribute__((target("popcnt"))))
+
+KERNEL_BODY __attribute__((target("avx2,popcnt")))
+void mask_avx2_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                    const uint8_t *mask, uint8_t c, size_t len,
+                    struct diffcount_res *dr)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i m, x, acc = zero, acc_10 = zero, acc_m = zero;
+	unsigned long long diff_B = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		m = _mm256_loadu_si256((const __m256i *)(mask + i));
+		x = _mm256_and_si256(load_xor_avx2(buf_1, buf_2, c, i), m);
+		diff_B += 32 - _mm_popcnt_u32(_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(x, zero)));
+		acc = _mm256_add_epi64(acc, popcnt64_avx2(x));
+		acc_10 = _mm256_add_epi64(acc_10, popcnt64_avx2(
+			_mm256_and_si256(load_clr_avx2(buf_1, buf_2, c, i), m)));
+		acc_m = _mm256_add_epi64(acc_m, popcnt64_avx2(m));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += hsum64_avx2(acc);
+	dr->flip_10 += hsum64_avx2(acc_10);
+	dr->mask_b += hsum64_avx2(acc_m);
+	mask_popcnt(buf_1 + i, buf_2 ? buf_2 + i : NULL, mask + i, c, len - i,
+	            dr);
+}
+
+DEFINE_MASKED(mask_avx2, __attribute__((target("avx2,popcnt"))))
+
+/* The masked XOR and the masked flipped bits are each a single
+   vpternlogq: (a ^ b) & m is 0x28, and a & ~b & m is 0x20 */
+KERNEL_BODY __attribute__((target("avx512f,avx512bw,popcnt")))
+void mask_avx512bw_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                        const uint8_t *mask, uint8_t c, size_t len,
+                        struct diffcount_res *dr)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i a, b, m, x, acc = zero, acc_10 = zero, acc_m = zero;
+	unsigned long long diff_B = 0;
+	__mmask64 k;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		k = tail_mask(i, len);
+		a = _mm512_maskz_loadu_epi8(k, buf_1 + i);
+		b = buf_2 ? _mm512_maskz_loadu_epi8(k, buf_2 + i) :
+		            _mm512_set1_epi8(c);
+		m = _mm512_maskz_loadu_epi8(k, mask + i);
+		x = _mm512_ternarylogic_epi64(a, b, m, 0x28);
+		diff_B += _mm_popcnt_u64(_mm512_test_epi8_mask(x, x));
+		acc = _mm512_add_epi64(acc, popcnt64_avx512bw(x));
+		acc_10 = _mm512_add_epi64(acc_10, popcnt64_avx512bw(
+			_mm512_ternarylogic_epi64(a, b, m, 0x20)));
+		acc_m = _mm512_add_epi64(acc_m, popcnt64_avx512bw(m));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += _mm512_reduce_add_epi64(acc);
+	dr->flip_10 += _mm512_reduce_add_epi64(acc_10);
+	dr->mask_b += _mm512_reduce_add_epi64(acc_m);
+}
+
+DEFINE_MASKED(mask_avx512bw, __attribute__((target("avx512f,avx512bw,popcnt"))))
+
+/* As mask_avx512bw, but counting bits with VPOPCNTQ */
+KERNEL_BODY
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt")))
+void mask_avx512vpopcntdq_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                               const uint8_t *mask, uint8_t c, size_t len,
+                               struct diffcount_res *dr)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i a, b, m, x, acc = zero, acc_10 = zero, acc_m = zero;
+	unsigned long long diff_B = 0;
+	__mmask64 k;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		k = tail_mask(i, len);
+		a = _mm512_maskz_loadu_epi8(k, buf_1 + i);
+		b = buf_2 ? _mm512_maskz_loadu_epi8(k, buf_2 + i) :
+		            _mm512_set1_epi8(c);
+		m = _mm512_maskz_loadu_epi8(k, mask + i);
+		x = _mm512_ternarylogic_epi64(a, b, m, 0x28);
+		diff_B += _mm_popcnt_u64(_mm512_test_epi8_mask(x, x));
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+		acc_10 = _mm512_add_epi64(acc_10, _mm512_popcnt_epi64(
+			_mm512_ternarylogic_epi64(a, b, m, 0x20)));
+		acc_m = _mm512_add_epi64(acc_m, _mm512_popcnt_epi64(m));
+	}
+
+	dr->diff_B += diff_B;
+	dr->diff_b += _mm512_reduce_add_epi64(acc);
+	dr->flip_10 += _mm512_reduce_add_epi64(acc_10);
+	dr->mask_b += _mm512_reduce_add_epi64(acc_m);
+}
+
+DEFINE_MASKED(mask_avx512vpopcntdq,
+              __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt"))))
+
+/*
+ * Positional popcount
+ *
+ * With -L, differing bits are also counted by their position within a
+ * 64-bit little-endian word, counted from seek1. Byte, 16-bit and 32-bit
+ * positions are folded from these when printing.
+ *
+ * Lane functions add to lanes[8*b + k] the number of differing bits k of
+ * bytes b mod 8 of the block, against buf_2 or, when that is NULL, the
+ * constant. The scalar version keeps eight byte-sliced counters per bit in
+ * a 64-bit word. The vector versions first fold 16 XOR vectors with the
+ * Harley-Seal carry-save adders, which keep bit positions apart, and only
+ * split the resulting weight-16 vector into bit planes, counting each
+ * plane bytewise.
+ */
+
+#define DEFINE_LANES(name, attr)                                        \
+attr static void name(const uint8_t *buf_1, const uint8_t *buf_2,      \
+                      uint8_t const_val, size_t len,                    \
+                      unsigned long long *lanes)                        \
+{                                                                       \
+	if (buf_2 != NULL)                                              \
+		name##_body(buf_1, buf_2, 0, len, lanes);               \
+	else                                                            \
+		name##_body(buf_1, NULL, const_val, len, lanes);        \
+}
+
+KERNEL_BODY
+void lanes_scalar_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                       size_t len, unsigned long long *lanes)
+{
+	const uint64_t pattern = c*0x0101010101010101ULL;
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint64_t x, acc[8];
+	unsigned n, k, b;
+	size_t i = 0;
+
+	while (i + 8 <= len) {
+		memset(acc, 0, sizeof(acc));
+		/* Byte counters overflow after 255 words */
+		for (n = 0; n < 255 && i + 8 <= len; n++, i += 8) {
+			x = load64(buf_1 + i) ^
+			    (buf_2 ? load64(buf_2 + i) : pattern);
+			for (k = 0; k < 8; k++)
+				acc[k] += (x >> k) & ones;
+		}
+		for (k = 0; k < 8; k++)
+			for (b = 0; b < 8; b++)
+				lanes[8*b + k] += (acc[k] >> 8*b) & 0xff;
+	}
+	for (; i < len; i++) {
+		x = buf_1[i] ^ (buf_2 ? buf_2[i] : c);
+		for (k = 0; k < 8; k++)
+			lanes[8*(i % 8) + k] += (x >> k) & 1;
+	}
+}
+
+#define lanes_generic_body lanes_scalar_body
+
+DEFINE_LANES(lanes_generic, )
+
+/* Add weight times bytewise counters cnt of bit k to lanes */
+static void lanes_add_counts(const uint8_t *cnt, size_t n, unsigned k,
+                             unsigned weight, unsigned long long *lanes)
+{
+	size_t j;
+
+	for (j = 0; j < n; j++)
+		lanes[8*(j % 8) + k] += (unsigned long long)weight*cnt[j];
+}
+
+/* Add weight times the bits of the n bytes of v to lanes */
+static void lanes_add_bits(const uint8_t *v, size_t n, unsigned weight,
+                           unsigned long long *lanes)
+{
+	unsigned k;
+	size_t j;
+
+	for (j = 0; j < n; j++)
+		for (k = 0; k < 8; k++)
+			lanes[8*(j % 8) + k] += weight*((v[j] >> k) & 1);
+}
+
+KERNEL_BODY __attribute__((target("avx2")))
+void lanes_avx2_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                     size_t len, unsigned long long *lanes)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	__m256i ones = zero, twos = zero, fours = zero, eights = zero;
+	__m256i sixteens, acc[8];
+	uint8_t tmp[32];
+	unsigned n, k;
+	size_t i = 0;
+
+	while (i + 16*32 <= len) {
+		for (k = 0; k < 8; k++) acc[k] = zero;
+		for (n = 0; n < 255 && i + 16*32 <= len; n++, i += 16*32) {
+			sixteens = csa16_avx2(buf_1, buf_2, c, 0, i, &ones, &twos,
+			                      &fours, &eights);
+			for (k = 0; k < 8; k++)
+				acc[k] = _mm256_add_epi8(acc[k], _mm256_and_si256(
+					_mm256_srli_epi16(sixteens, k), one));
+		}
+		for (k = 0; k < 8; k++) {
+			_mm256_storeu_si256((__m256i *)tmp, acc[k]);
+			lanes_add_counts(tmp, 32, k, 16, lanes);
+		}
+	}
+	_mm256_storeu_si256((__m256i *)tmp, ones);
+	lanes_add_bits(tmp, 32, 1, lanes);
+	_mm256_storeu_si256((__m256i *)tmp, twos);
+	lanes_add_bits(tmp, 32, 2, lanes);
+	_mm256_storeu_si256((__m256i *)tmp, fours);
+	lanes_add_bits(tmp, 32, 4, lanes);
+	_mm256_storeu_si256((__m256i *)tmp, eights);
+	lanes_add_bits(tmp, 32, 8, lanes);
+
+	lanes_scalar_body(buf_1 + i, buf_2 ? buf_2 + i : NULL, c, len - i,
+	                  lanes);
+}
+
+DEFINE_LANES(lanes_avx2, __attribute__((target("avx2"))))
+
+KERNEL_BODY __attribute__((target("avx512f,avx512bw")))
+void lanes_avx512bw_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                         uint8_t c, size_t len, unsigned long long *lanes)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi8(1);
+	__m512i ones = zero, twos = zero, fours = zero, eights = zero;
+	__m512i sixteens, acc[8];
+	uint8_t tmp[64];
+	unsigned n, k;
+	size_t i = 0;
+
+	while (i + 16*64 <= len) {
+		for (k = 0; k < 8; k++) acc[k] = zero;
+		for (n = 0; n < 255 && i + 16*64 <= len; n++, i += 16*64) {
+			sixteens = csa16_avx512(buf_1, buf_2, c, 0, i, &ones,
+			                        &twos, &fours, &eights);
+			for (k = 0; k < 8; k++)
+				acc[k] = _mm512_add_epi8(acc[k], _mm512_and_si512(
+					_mm512_srli_epi16(sixteens, k), one));
+		}
+		for (k = 0; k < 8; k++) {
+			_mm512_storeu_si512(tmp, acc[k]);
+			lanes_add_counts(tmp, 64, k, 16, lanes);
+		}
+	}
+	_mm512_storeu_si512(tmp, ones);
+	lanes_add_bits(tmp, 64, 1, lanes);
+	_mm512_storeu_si512(tmp, twos);
+	lanes_add_bits(tmp, 64, 2, lanes);
+	_mm512_storeu_si512(tmp, fours);
+	lanes_add_bits(tmp, 64, 4, lanes);
+	_mm512_storeu_si512(tmp, eights);
+	lanes_add_bits(tmp, 64, 8, lanes);
+
+	lanes_scalar_body(buf_1 + i, buf_2 ? buf_2 + i : NULL, c, len - i,
+	                  lanes);
+}
+
+DEFINE_LANES(lanes_avx512bw, __attribute__((target("avx512f,avx512bw"))))
+
+/*
+ * Codeword error weights
+ *
+ * With -E, the compared range is cut into codewords of a multiple of 64
+ * bits counted from seek1, and codewords are counted by how many of their
+ * bits differ. Word functions store the number of differing bits of each
+ * 64-bit word of the block, against buf_2 or, when that is NULL, the
+ * constant, and the weights are summed per codeword from there.
+ */
+
+#define DEFINE_WORDS(name, attr)                                        \
+attr static void name(const uint8_t *buf_1, const uint8_t *buf_2,      \
+                      uint8_t const_val, size_t n, uint64_t *w)         \
+{                                                                       \
+	if (buf_2 != NULL)                                              \
+		name##_body(buf_1, buf_2, 0, n, w);                     \
+	else                                                            \
+		name##_body(buf_1, NULL, const_val, n, w);              \
+}
+
+KERNEL_BODY
+void words_scalar_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                       size_t n, uint64_t *w)
+{
+	const uint64_t pattern = c*0x0101010101010101ULL;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		w[i] = __builtin_popcountll(load64(buf_1 + 8*i) ^
+			(buf_2 ? load64(buf_2 + 8*i) : pattern));
+}
+
+#define words_generic_body words_scalar_body
+#define words_popcnt_body words_scalar_body
+
+DEFINE_WORDS(words_generic, )
+DEFINE_WORDS(words_popcnt, __attribute__((target("popcnt"))))
+
+KERNEL_BODY __attribute__((target("avx2,popcnt")))
+void words_avx2_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                     size_t n, uint64_t *w)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm256_storeu_si256((__m256i *)(w + i), popcnt64_avx2(
+			load_xor_avx2(buf_1, buf_2, c, 8*i)));
+	words_scalar_body(buf_1 + 8*i, buf_2 ? buf_2 + 8*i : NULL, c,
+	                  n - i, w + i);
+}
+
+DEFINE_WORDS(words_avx2, __attribute__((target("avx2,popcnt"))))
+
+KERNEL_BODY __attribute__((target("avx512f,avx512bw")))
+void words_avx512bw_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                         uint8_t c, size_t n, uint64_t *w)
+{
+	size_t i;
+
+	for (i = 0; i < n; i += 8)
+		_mm512_mask_storeu_epi64(w + i, tail_mask(i, n),
+			popcnt64_avx512bw(load_xor_avx512(buf_1, buf_2, c,
+				8*i, tail_mask(8*i, 8*n))));
+}
+
+DEFINE_WORDS(words_avx512bw, __attribute__((target("avx512f,avx512bw"))))
+
+KERNEL_BODY __attribute__((target("avx512f,avx512bw,avx512vpopcntdq")))
+void words_avx512vpopcntdq_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                                uint8_t c, size_t n, uint64_t *w)
+{
+	size_t i;
+
+	for (i = 0; i < n; i += 8)
+		_mm512_mask_storeu_epi64(w + i, tail_mask(i, n),
+			_mm512_popcnt_epi64(load_xor_avx512(buf_1, buf_2, c,
+				8*i, tail_mask(8*i, 8*n))));
+}
+
+DEFINE_WORDS(words_avx512vpopcntdq,
+             __attribute__((target("avx512f,avx512bw,avx512vpopcntdq"))))
+
+/*
+ * Difference masks
+ *
+ * With -l, differing byte ranges are listed. Mask functions set bit j of
+ * m[k] when byte 64*k + j of the block differs, against buf_2 or, when
+ * that is NULL, the constant, so equal 64-byte blocks are skipped with a
+ * single test and only the others are scanned for runs.
+ */
+
+#define DEFINE_MASKS(name, attr)                                        \
+attr static void name(const uint8_t *buf_1, const uint8_t *buf_2,      \
+                      uint8_t const_val, size_t len, uint64_t *m)       \
+{                                                                       \
+	if (buf_2 != NULL)                                              \
+		name##_body(buf_1, buf_2, 0, len, m);                   \
+	else                                                            \
+		name##_body(buf_1, NULL, const_val, len, m);            \
+}
+
+KERNEL_BODY
+void masks_scalar_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                       size_t len, uint64_t *m)
+{
+	const uint64_t pattern = c*0x0101010101010101ULL;
+	uint64_t x;
+	size_t i;
+
+	memset(m, 0, (len + 63)/64*sizeof(uint64_t));
+	for (i = 0; i + 8 <= len; i += 8) {
+		x = load64(buf_1 + i) ^ (buf_2 ? load64(buf_2 + i) : pattern);
+		/* Gather the high bits of the bytes into the top byte */
+		x = (nonzero_bytes(x) >> 7)*0x0102040810204080ULL >> 56;
+		m[i/64] |= x << i % 64;
+	}
+	for (; i < len; i++)
+		if (buf_1[i] != (buf_2 ? buf_2[i] : c))
+			m[i/64] |= 1ULL << i % 64;
+}
+
+#define masks_generic_body masks_scalar_body
+
+DEFINE_MASKS(masks_generic, )
+
+KERNEL_BODY __attribute__((target("avx2")))
+void masks_avx2_body(const uint8_t *buf_1, const uint8_t *buf_2, uint8_t c,
+                     size_t len, uint64_t *m)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t lo, hi;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		lo = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			load_xor_avx2(buf_1, buf_2, c, i), zero));
+		hi = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			load_xor_avx2(buf_1, buf_2, c, i + 32), zero));
+		m[i/64] = (uint64_t)hi << 32 | lo;
+	}
+	if (i < len)
+		masks_scalar_body(buf_1 + i, buf_2 ? buf_2 + i : NULL, c,
+		                  len - i, m + i/64);
+}
+
+DEFINE_MASKS(masks_avx2, __attribute__((target("avx2"))))
+
+KERNEL_BODY __attribute__((target("avx512f,avx512bw")))
+void masks_avx512bw_body(const uint8_t *buf_1, const uint8_t *buf_2,
+                         uint8_t c, size_t len, uint64_t *m)
+{
+	__m512i x;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		x = load_xor_avx512(buf_1, buf_2, c, i, tail_mask(i, len));
+		m[i/64] = _mm512_test_epi8_mask(x, x);
+	}
+}
+
+DEFINE_MASKS(masks_avx512bw, __attribute__((target("avx512f,avx512bw"))))
+
+/*
+ * Bit realignment
+ *
+ * Inputs can start at any bit, most significant first. Shift functions
+ * realign such a stream to whole bytes ahead of the compare kernels, each
+ * output byte being the funnel shift of two neighbouring input bytes. The
+ * vector versions shift 16-bit lanes and mask off the bits that crossed
+ * into the neighbouring byte.
+ */
+
+static void shift_generic(const uint8_t *buf, unsigned k, size_t len,
+                          uint8_t *out)
+{
+	uint64_t x;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		x = __builtin_bswap64(load64(buf + i));
+		x = x << k | buf[i + 8] >> (8 - k);
+		x = __builtin_bswap64(x);
+		memcpy(out + i, &x, sizeof(x));
+	}
+	for (; i < len; i++)
+		out[i] = buf[i] << k | buf[i + 1] >> (8 - k);
+}
+
+__attribute__((target("avx2")))
+static void shift_avx2(const uint8_t *buf, unsigned k, size_t len,
+                       uint8_t *out)
+{
+	const __m256i hi = _mm256_set1_epi8((uint8_t)(0xff << k));
+	const __m256i lo = _mm256_set1_epi8(0xff >> (8 - k));
+	const __m128i cnt_l = _mm_cvtsi32_si128(k);
+	const __m128i cnt_r = _mm_cvtsi32_si128(8 - k);
+	__m256i a, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(buf + i));
+		b = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+		a = _mm256_and_si256(_mm256_sll_epi16(a, cnt_l), hi);
+		b = _mm256_and_si256(_mm256_srl_epi16(b, cnt_r), lo);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_or_si256(a, b));
+	}
+	if (i < len) shift_generic(buf + i, k, len - i, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void shift_avx512bw(const uint8_t *buf, unsigned k, size_t len,
+                           uint8_t *out)
+{
+	const __m512i hi = _mm512_set1_epi8((uint8_t)(0xff << k));
+	const __m512i lo = _mm512_set1_epi8(0xff >> (8 - k));
+	const __m128i cnt_l = _mm_cvtsi32_si128(k);
+	const __m128i cnt_r = _mm_cvtsi32_si128(8 - k);
+	__m512i a, b;
+	__mmask64 mask;
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		mask = tail_mask(i, len);
+		a = _mm512_maskz_loadu_epi8(mask, buf + i);
+		b = _mm512_maskz_loadu_epi8(mask, buf + i + 1);
+		a = _mm512_and_si512(_mm512_sll_epi16(a, cnt_l), hi);
+		b = _mm512_and_si512(_mm512_srl_epi16(b, cnt_r), lo);
+		_mm512_mask_storeu_epi8(out + i, mask, _mm512_or_si512(a, b));
+	}
+}
+
+/*
+ * N-way voting
+ *
+ * With -N, the bits at each position are counted across the inputs in
+ * VOTE_PLANES bit-sliced planes, plane j holding bit j of the count for
+ * every bit of a word or vector at once. Inputs are folded in three at a
+ * time by a carry-save adder, whose sum and carry go into the planes at
+ * weights one and two, and the counts are compared against constants a
+ * plane at a time. The vote itself is all bitwise logic; popcounts are
+ * only needed for the statistics.
+ */
+
+#define DEFINE_VOTE(name, attr)                                         \
+attr static void name(const uint8_t *const *bufs, unsigned n,          \
+                      size_t len, uint8_t *out, struct vote_res *vr)    \
+{                                                                       \
+	name##_body(bufs, n, len, out, vr);                             \
+}
+
+/* Add v into the count planes c at weight 2^j */
+#define VOTE_ADD(c, v, j, and, xor) do {                                \
+	__typeof__(c[0]) v_ = (v), t_;                                  \
+	unsigned j_;                                                    \
+	for (j_ = (j); j_ < VOTE_PLANES; j_++) {                        \
+		t_ = and(c[j_], v_);                                    \
+		c[j_] = xor(c[j_], v_);                                 \
+		v_ = t_;                                                \
+	}                                                               \
+} while (0)
+
+/* Bits whose count in planes c is k, and over k */
+#define VOTE_EQ(eq, c, k, ones, and, andnot) do {                       \
+	unsigned j_;                                                    \
+	eq = (ones);                                                    \
+	for (j_ = 0; j_ < VOTE_PLANES; j_++)                            \
+		eq = ((k) >> j_ & 1) ? and(eq, c[j_]) : andnot(c[j_], eq); \
+} while (0)
+
+#define VOTE_GT(gt, c, k, ones, zero, and, andnot, or) do {             \
+	__typeof__(gt) eq_ = (ones);                                    \
+	unsigned j_ = VOTE_PLANES;                                      \
+	gt = (zero);                                                    \
+	while (j_-- > 0) {                                              \
+		if ((k) >> j_ & 1) {                                    \
+			eq_ = and(eq_, c[j_]);                          \
+		} else {                                                \
+			gt = or(gt, and(eq_, c[j_]));                   \
+			eq_ = andnot(c[j_], eq_);                       \
+		}                                                       \
+	}                                                               \
+} while (0)
+
+#define AND64(a, b) ((a) & (b))
+#define ANDNOT64(a, b) (~(a) & (b))
+#define OR64(a, b) ((a) | (b))
+#define XOR64(a, b) ((a) ^ (b))
+
+/* The majority of one word from each of the n inputs in x */
+KERNEL_BODY
+uint64_t vote_word64(const uint64_t *x, unsigned n, struct vote_res *vr)
+{
+	uint64_t c[VOTE_PLANES] = { 0 }, h, l, u, maj, eq, eq_n, dis;
+	unsigned f, k;
+
+	for (f = 0; f + 3 <= n; f += 3) {
+		u = x[f] ^ x[f + 1];
+		h = (x[f] & x[f + 1]) | (u & x[f + 2]);
+		l = u ^ x[f + 2];
+		VOTE_ADD(c, l, 0, AND64, XOR64);
+		VOTE_ADD(c, h, 1, AND64, XOR64);
+	}
+	for (; f < n; f++)
+		VOTE_ADD(c, x[f], 0, AND64, XOR64);
+
+	VOTE_GT(maj, c, n/2, ~0ULL, 0, AND64, ANDNOT64, OR64);
+	if (n % 2 == 0) {
+		VOTE_EQ(eq, c, n/2, ~0ULL, AND64, ANDNOT64);
+		maj |= eq & x[0];
+	}
+	VOTE_EQ(eq, c, 0, ~0ULL, AND64, ANDNOT64);
+	VOTE_EQ(eq_n, c, n, ~0ULL, AND64, ANDNOT64);
+	dis = ~(eq | eq_n);
+	vr->any_b += __builtin_popcountll(dis);
+	vr->any_B += __builtin_popcountll(nonzero_bytes(dis));
+	for (k = 1; k <= n/2; k++) {
+		VOTE_EQ(eq, c, k, ~0ULL, AND64, ANDNOT64);
+		VOTE_EQ(eq_n, c, n - k, ~0ULL, AND64, ANDNOT64);
+		vr->hist[k] += __builtin_popcountll(eq | eq_n);
+	}
+	for (f = 0; f < n; f++)
+		vr->copy_b[f] += __builtin_popcountll(x[f] ^ maj);
+	return maj;
+}
+
+/* A word at a time, with the tail voted on zero-padded copies, which
+   agree in the padding */
+KERNEL_BODY
+void vote_scalar_body(const uint8_t *const *bufs, unsigned n, size_t len,
+                      uint8_t *out, struct vote_res *vr)
+{
+	uint64_t x[VOTE_MAX], maj;
+	size_t i;
+	unsigned f;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		for (f = 0; f < n; f++)
+			x[f] = load64(bufs[f] + i);
+		maj = vote_word64(x, n, vr);
+		if (out) memcpy(out + i, &maj, 8);
+	}
+	if (i == len) return;
+	for (f = 0; f < n; f++) {
+		x[f] = 0;
+		memcpy(&x[f], bufs[f] + i, len - i);
+	}
+	maj = vote_word64(x, n, vr);
+	if (out) memcpy(out + i, &maj, len - i);
+}
+
+#define vote_generic_body vote_scalar_body
+#define vote_popcnt_body vote_scalar_body
+
+DEFINE_VOTE(vote_generic, )
+DEFINE_VOTE(vote_popcnt, __attribute__((target("popcnt"))))
+
+/* 32 bytes per step, with the counts summed per 64-bit lane and the tail
+   left to the scalar kernel */
+KERNEL_BODY __attribute__((target("avx2,popcnt")))
+void vote_avx2_body(const uint8_t *const *bufs, unsigned n, size_t len,
+                    uint8_t *out, struct vote_res *vr)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi8(-1);
+	__m256i x[VOTE_MAX], c[VOTE_PLANES], h, l, maj, eq, eq_n, dis;
+	__m256i any_b = zero, hist[VOTE_MAX/2 + 1], copy_b[VOTE_MAX];
+	const uint8_t *rest[VOTE_MAX];
+	uint64_t any_B = 0;
+	unsigned f, j, k;
+	size_t i;
+
+	for (k = 0; k <= n/2; k++) hist[k] = zero;
+	for (f = 0; f < n; f++) copy_b[f] = zero;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (f = 0; f < n; f++)
+			x[f] = _mm256_loadu_si256((const __m256i *)(bufs[f] + i));
+		for (j = 0; j < VOTE_PLANES; j++) c[j] = zero;
+		for (f = 0; f + 3 <= n; f += 3) {
+			CSA_AVX2(h, l, x[f], x[f + 1], x[f + 2]);
+			VOTE_ADD(c, l, 0, _mm256_and_si256, _mm256_xor_si256);
+			VOTE_ADD(c, h, 1, _mm256_and_si256, _mm256_xor_si256);
+		}
+		for (; f < n; f++)
+			VOTE_ADD(c, x[f], 0, _mm256_and_si256, _mm256_xor_si256);
+
+		VOTE_GT(maj, c, n/2, ones, zero, _mm256_and_si256,
+		        _mm256_andnot_si256, _mm256_or_si256);
+		if (n % 2 == 0) {
+			VOTE_EQ(eq, c, n/2, ones, _mm256_and_si256,
+			        _mm256_andnot_si256);
+			maj = _mm256_or_si256(maj, _mm256_and_si256(eq, x[0]));
+		}
+		VOTE_EQ(eq, c, 0, ones, _mm256_and_si256, _mm256_andnot_si256);
+		VOTE_EQ(eq_n, c, n, ones, _mm256_and_si256,
+		        _mm256_andnot_si256);
+		dis = _mm256_andnot_si256(_mm256_or_si256(eq, eq_n), ones);
+		any_b = _mm256_add_epi64(any_b, popcnt64_avx2(dis));
+		any_B += 32 - __builtin_popcount(_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(dis, zero)));
+		for (k = 1; k <= n/2; k++) {
+			VOTE_EQ(eq, c, k, ones, _mm256_and_si256,
+			        _mm256_andnot_si256);
+			VOTE_EQ(eq_n, c, n - k, ones, _mm256_and_si256,
+			        _mm256_andnot_si256);
+			hist[k] = _mm256_add_epi64(hist[k], popcnt64_avx2(
+				_mm256_or_si256(eq, eq_n)));
+		}
+		for (f = 0; f < n; f++)
+			copy_b[f] = _mm256_add_epi64(copy_b[f], popcnt64_avx2(
+				_mm256_xor_si256(x[f], maj)));
+		if (out) _mm256_storeu_si256((__m256i *)(out + i), maj);
+	}
+
+	vr->any_b += hsum64_avx2(any_b);
+	vr->any_B += any_B;
+	for (k = 1; k <= n/2; k++) vr->hist[k] += hsum64_avx2(hist[k]);
+	for (f = 0; f < n; f++) vr->copy_b[f] += hsum64_avx2(copy_b[f]);
+	if (i == len) return;
+	for (f = 0; f < n; f++) rest[f] = bufs[f] + i;
+	vote_scalar_body(rest, n, len - i, out ? out + i : NULL, vr);
+}
+
+DEFINE_VOTE(vote_avx2, __attribute__((target("avx2,popcnt"))))
+
+/* 64 bytes per step, with the tail masked and zero-filled, and counts
+   from popcnt64 */
+#define VOTE_AVX512_BODY(name, attr, popcnt64)                         \
+KERNEL_BODY attr                                                        \
+void name##_body(const uint8_t *const *bufs, unsigned n, size_t len,   \
+                 uint8_t *out, struct vote_res *vr)                     \
+{                                                                       \
+	const __m512i zero = _mm512_setzero_si512();                    \
+	const __m512i ones = _mm512_set1_epi8(-1);                      \
+	__m512i x[VOTE_MAX], c[VOTE_PLANES], h, l, maj, eq, eq_n, dis;  \
+	__m512i any_b = zero, hist[VOTE_MAX/2 + 1], copy_b[VOTE_MAX];   \
+	uint64_t any_B = 0;                                             \
+	__mmask64 m;                                                    \
+	unsigned f, j, k;                                               \
+	size_t i;                                                       \
+                                                                        \
+	for (k = 0; k <= n/2; k++) hist[k] = zero;                      \
+	for (f = 0; f < n; f++) copy_b[f] = zero;                       \
+                                                                        \
+	for (i = 0; i < len; i += 64) {                                 \
+		m = tail_mask(i, len);                                  \
+		for (f = 0; f < n; f++)                                 \
+			x[f] = _mm512_maskz_loadu_epi8(m, bufs[f] + i); \
+		for (j = 0; j < VOTE_PLANES; j++) c[j] = zero;          \
+		for (f = 0; f + 3 <= n; f += 3) {                       \
+			CSA_AVX512(h, l, x[f], x[f + 1], x[f + 2]);     \
+			VOTE_ADD(c, l, 0, _mm512_and_si512,             \
+			         _mm512_xor_si512);                     \
+			VOTE_ADD(c, h, 1, _mm512_and_si512,             \
+			         _mm512_xor_si512);                     \
+		}                                                       \
+		for (; f < n; f++)                                      \
+			VOTE_ADD(c, x[f], 0, _mm512_and_si512,          \
+			         _mm512_xor_si512);                     \
+                                                                        \
+		VOTE_GT(maj, c, n/2, ones, zero, _mm512_and_si512,      \
+		        _mm512_andnot_si512, _mm512_or_si512);          \
+		if (n % 2 == 0) {                                       \
+			VOTE_EQ(eq, c, n/2, ones, _mm512_and_si512,     \
+			        _mm512_andnot_si512);                   \
+			maj = _mm512_ternarylogic_epi64(maj, eq, x[0],  \
+			                                0xf8);          \
+		}                                                       \
+		VOTE_EQ(eq, c, 0, ones, _mm512_and_si512,               \
+		        _mm512_andnot_si512);                           \
+		VOTE_EQ(eq_n, c, n, ones, _mm512_and_si512,             \
+		        _mm512_andnot_si512);                           \
+		dis = _mm512_ternarylogic_epi64(eq, eq_n, eq_n, 0x03);  \
+		any_b = _mm512_add_epi64(any_b, popcnt64(dis));         \
+		any_B += __builtin_popcountll(                          \
+			_mm512_test_epi8_mask(dis, dis));               \
+		for (k = 1; k <= n/2; k++) {                            \
+			VOTE_EQ(eq, c, k, ones, _mm512_and_si512,       \
+			        _mm512_andnot_si512);                   \
+			VOTE_EQ(eq_n, c, n - k, ones, _mm512_and_si512, \
+			        _mm512_andnot_si512);                   \
+			hist[k] = _mm512_add_epi64(hist[k], popcnt64(   \
+				_mm512_or_si512(eq, eq_n)));            \
+		}                                                       \
+		for (f = 0; f < n; f++)                                 \
+			copy_b[f] = _mm512_add_epi64(copy_b[f], popcnt64( \
+				_mm512_xor_si512(x[f], maj)));          \
+		if (out) _mm512_mask_storeu_epi8(out + i, m, maj);      \
+	}                                                               \
+                                                                        \
+	vr->any_b += _mm512_reduce_add_epi64(any_b);                    \
+	vr->any_B += any_B;                                             \
+	for (k = 1; k <= n/2; k++)                                      \
+		vr->hist[k] += _mm512_reduce_add_epi64(hist[k]);        \
+	for (f = 0; f < n; f++)                                         \
+		vr->copy_b[f] += _mm512_reduce_add_epi64(copy_b[f]);    \
+}
+
+VOTE_AVX512_BODY(vote_avx512bw, __attribute__((target("avx512f,avx512bw,popcnt"))),
+                 popcnt64_avx512bw)
+DEFINE_VOTE(vote_avx512bw, __attribute__((target("avx512f,avx512bw,popcnt"))))
+
+VOTE_AVX512_BODY(vote_avx512vpopcntdq,
+                 __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt"))),
+                 _mm512_popcnt_epi64)
+DEFINE_VOTE(vote_avx512vpopcntdq,
+            __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,popcnt"))))
+
+static int cpu_generic(void)
+{
+	return 1;
+}
+
+static int cpu_popcnt(void)
+{
+	return __builtin_cpu_supports("popcnt");
+}
+
+static int cpu_avx2(void)
+{
+	return __builtin_cpu_supports("avx2") &&
+	       __builtin_cpu_supports("popcnt");
+}
+
+static int cpu_avx512bw(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512bw") &&
+	       __builtin_cpu_supports("popcnt");
+}
+
+static int cpu_avx512vpopcntdq(void)
+{
+	return cpu_avx512bw() &&
+	       __builtin_cpu_supports("avx512vpopcntdq");
+}
+
+/* Available kernels, in order of preference */
+static const struct diff_kernel diff_kernels[] = {
+#define KERNEL(name, fn, mask, lanes, words, masks, shift, vote, supported) \
+	{ name, fn, fn##_const, mask, lanes, words, masks, shift, vote, \
+	  supported }
+	KERNEL("avx512bw-hs",     diff_avx512bw_hs,     mask_avx512bw,
+	       lanes_avx512bw, words_avx512bw, masks_avx512bw, shift_avx512bw,
+	       vote_avx512bw, cpu_avx512bw),
+	KERNEL("avx512vpopcntdq", diff_avx512vpopcntdq, mask_avx512vpopcntdq,
+	       lanes_avx512bw, words_avx512vpopcntdq, masks_avx512bw,
+	       shift_avx512bw, vote_avx512vpopcntdq, cpu_avx512vpopcntdq),
+	KERNEL("avx512bw",        diff_avx512bw,        mask_avx512bw,
+	       lanes_avx512bw, words_avx512bw, masks_avx512bw, shift_avx512bw,
+	       vote_avx512bw, cpu_avx512bw),
+	KERNEL("avx2-hs",         diff_avx2_hs,         mask_avx2,
+	       lanes_avx2, words_avx2, masks_avx2, shift_avx2, vote_avx2,
+	       cpu_avx2),
+	KERNEL("avx2",            diff_avx2,            mask_avx2,
+	       lanes_avx2, words_avx2, masks_avx2, shift_avx2, vote_avx2,
+	       cpu_avx2),
+	KERNEL("popcnt",          diff_popcnt,          mask_popcnt,
+	       lanes_generic, words_popcnt, masks_generic, shift_generic,
+	       vote_popcnt, cpu_popcnt),
+	KERNEL("generic",         diff_generic,         mask_generic,
+	       lanes_generic, words_generic, masks_generic, shift_generic,
+	       vote_generic, cpu_generic),
+#undef KERNEL
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/* Look up a kernel by name. "auto" picks the best one this CPU supports. */
+static const struct diff_kernel *select_kernel(const char *name)
+{
+	const struct diff_kernel *k;
+
+	__builtin_cpu_init();
+	for (k = diff_kernels; k->name != NULL; k++) {
+		if (strcmp(name, "auto") != 0 && strcmp(name, k->name) != 0)
+			continue;
+		if (k->supported()) return k;
+		if (strcmp(name, "auto") != 0) {
+			fprintf(stderr, "kernel %s: not supported by this CPU\n",
+			        name);
+			exit(EXIT_TROUBLE);
+		}
+	}
+	fprintf(stderr, "kernel %s: unknown\n", name);
+	exit(EXIT_TROUBLE);
+}
+
+/* Page-aligned allocation, suitable for any kind of I/O */
+static void *aligned_malloc_or_die(size_t size)
+{
+	void *buf;
+	int err;
+
+	err = posix_memalign(&buf, sysconf(_SC_PAGESIZE), size);
+	if (err != 0) {
+		fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+		exit(EXIT_TROUBLE);
+	}
+	return buf;
+}
+
+/* Repeat a pattern of len bytes over PATTERN_TILE bytes and one more
+   period, so that up to PATTERN_TILE bytes of it starting at any phase can
+   be read from the buffer */
+static uint8_t *tile_pattern(const uint8_t *pat, size_t len)
+{
+	uint8_t *buf;
+	size_t i;
+
+	buf = aligned_malloc_or_die(PATTERN_TILE + len);
+	for (i = 0; i < PATTERN_TILE + len; i++)
+		buf[i] = pat[i % len];
+	return buf;
+}
+
+/* Parse a size with an optional K, M or G (binary) suffix */
+static unsigned long long parse_size(const char *str)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K': return val << 10;
+	case 'm': case 'M': return val << 20;
+	case 'g': case 'G': return val << 30;
+	default: return val;
+	}
+}
+
+/* Parse a -t or -T limit, either a count as for parse_size() or, strictly
+   between 0 and 1, a fraction of what will be compared. Sets *count or
+   *frac, leaving the other alone. */
+static void parse_limit(const char *str, unsigned long long *count,
+                        double *frac)
+{
+	double val;
+	char *end;
+
+	val = strtod(str, &end);
+	if (*end == '\0' && val > 0 && val < 1)
+		*frac = val;
+	else
+		*count = parse_size(str);
+}
+
+/* Parse a seek as bytes, bytes.bits with 0 to 7 bits, or a decimal number
+   of bits with a b suffix. Returns nonzero if valid. */
+static int parse_seek(const char *str, unsigned long long *seek,
+                      unsigned *bit)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	*seek = val;
+	*bit = 0;
+	if (*end == '.') {
+		if (end[1] < '0' || end[1] > '7' || end[2] != '\0') return 0;
+		*bit = end[1] - '0';
+		return 1;
+	}
+	if (*end == 'b' && end[1] == '\0') {
+		*seek = val/8;
+		*bit = val % 8;
+		return 1;
+	}
+	return *end == '\0' && end != str;
+}
+
+/* Parse a string of hex digit pairs, with an optional 0x prefix, into a
+   new buffer. Sets *len to the number of bytes. Returns NULL if invalid. */
+static uint8_t *parse_hex(const char *str, size_t *len)
+{
+	uint8_t *buf;
+	char pair[3] = "";
+	size_t i;
+
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) str += 2;
+	*len = strlen(str)/2;
+	if (*len == 0 || strlen(str) % 2 != 0 ||
+	    strspn(str, "0123456789abcdefABCDEF") != strlen(str))
+		return NULL;
+	buf = malloc_or_die(*len);
+	for (i = 0; i < *len; i++) {
+		memcpy(pair, str + 2*i, 2);
+		buf[i] = strtoul(pair, NULL, 16);
+	}
+	return buf;
+}
+
+/* Monotonic time in seconds */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Initialize struct diffcount_ctl and set defaults */
+static struct diffcount_ctl *diffcount_ctl_init(void)
+{
+	struct diffcount_ctl *dc;
+
+	dc = malloc_or_die(sizeof(struct diffcount_ctl));
+	dc->fname_1 = NULL;
+	dc->fname_2 = NULL;
+	dc->seek_1 = 0;
+	dc->seek_2 = 0;
+	dc->bit_1 = 0;
+	dc->bit_2 = 0;
+	dc->max_len = 0;
+	dc->cmp_mode = CMP_FILE;
+	dc->ref = REF_BYTE;
+	dc->ref_pat = NULL;
+	dc->ref_period = 0;
+	dc->ref_width = 0;
+	dc->lfsr_name = NULL;
+	dc->lfsr_taps = 0;
+	dc->lfsr_len = 0;
+	dc->lfsr_seed = 0;
+	dc->lfsr_sync = 0;
+	dc->lfsr_inv = 0;
+	dc->kernel = NULL;
+	dc->engine = NULL;
+	dc->bufsize = BUFSIZE;
+	dc->ring_depth = 0;
+	dc->jobs = 1;
+	dc->direct = 0;
+	dc->align = DIRECT_ALIGN;
+	dc->readahead = 0;
+	dc->sparse = 1;
+	dc->shared = 0;
+	dc->verbose = 0;
+	dc->window = 0;
+	dc->prof_fname = NULL;
+	dc->prof_binary = 0;
+	dc->lane_width = 0;
+	dc->cw_bits = 0;
+	dc->cw_t = -1;
+	dc->range_fname = NULL;
+	dc->range_gap = 0;
+	dc->limit_B = NO_LIMIT;
+	dc->limit_b = NO_LIMIT;
+	dc->size_differ = 0;
+	dc->sample_B = 0;
+	dc->sample_err = 0;
+	dc->lag_search = 0;
+	dc->lag_min = 0;
+	dc->lag_max = 0;
+	dc->probe = ALIGN_PROBE;
+	dc->mask_fname = NULL;
+	dc->mask_pat = NULL;
+	dc->mask_period = 0;
+	dc->fnames = NULL;
+	dc->nfiles = 0;
+	dc->vote_fname = NULL;
+	dc->batch_fname = NULL;
+
+	return dc;
+}
+
+static FILE *fopen_and_seek(const char *filename, off_t seek)
+{
+	FILE *stream;
+
+	stream = fopen(filename, "r");
+	if (stream == NULL) {
+		fprintf(stderr, "fopen %s: %s\n", filename, strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	if (seek != 0 && fseeko(stream, seek, 0) == -1) {
+		if (errno != ESPIPE) {
+			fprintf(stderr, "fseeko %s: %s", filename,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+		/* Pipes can't seek, so skip ahead by reading */
+		while (seek > 0 && fgetc(stream) != EOF) seek--;
+	}
+	return stream;
+}
+
+static int open_or_die(const char *filename, int flags)
+{
+	int fd;
+
+	fd = open(filename, flags);
+	if (fd == -1) {
+		fprintf(stderr, "open %s: %s\n", filename, strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	return fd;
+}
+
+static off_t get_filesize(const char *filename)
+{
+	struct stat sb;
+	uint64_t size;
+	int fd;
+
+	if (stat(filename, &sb) == -1) {
+		fprintf(stderr, "fstat: %s: %s\n", filename,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	if (!S_ISBLK(sb.st_mode)) return sb.st_size;
+
+	/* stat() reports zero for block devices */
+	fd = open_or_die(filename, O_RDONLY);
+	if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+		fprintf(stderr, "BLKGETSIZE64: %s: %s\n", filename,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	close(fd);
+	return size;
+}
+
+/* Nonzero if filename is a block device */
+static int is_blockdev(const char *filename)
+{
+	struct stat sb;
+
+	return stat(filename, &sb) == 0 && S_ISBLK(sb.st_mode);
+}
+
+/* Get the logical and physical sector sizes of a block device */
+static void get_sectors(const char *filename, int *logical,
+                        unsigned *physical)
+{
+	int fd;
+
+	fd = open_or_die(filename, O_RDONLY);
+	if (ioctl(fd, BLKSSZGET, logical) == -1 ||
+	    ioctl(fd, BLKPBSZGET, physical) == -1) {
+		fprintf(stderr, "BLKSSZGET: %s: %s\n", filename,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	close(fd);
+}
+
+/* Set the readahead of a block device to ra bytes. Returns the previous
+   value, for restoring it afterwards. */
+static unsigned long long set_readahead(const char *filename,
+                                        unsigned long long ra)
+{
+	unsigned long old;
+	int fd;
+
+	fd = open_or_die(filename, O_RDONLY);
+	if (ioctl(fd, BLKRAGET, &old) == -1 ||
+	    ioctl(fd, BLKRASET, (unsigned long)(ra/512)) == -1) {
+		fprintf(stderr, "BLKRASET: %s: %s\n", filename,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	close(fd);
+	return old*512ULL;
+}
+
+/* Block devices whose readahead -a changed, in the order changed, with the
+   values to put back. Restored at exit too, so that a failed compare does
+   not leave them changed. */
+static struct {
+	const char *filename;
+	dev_t rdev;
+	unsigned long long ra;
+} ra_saved[VOTE_MAX];
+static unsigned ra_nsaved;
+
+/* Put back the readahead of the devices in ra_saved, last changed first.
+   Must not exit, as it also runs from atexit(). */
+static void restore_readahead(void)
+{
+	int fd;
+
+	while (ra_nsaved > 0) {
+		ra_nsaved--;
+		fd = open(ra_saved[ra_nsaved].filename, O_RDONLY);
+		if (fd == -1 ||
+		    ioctl(fd, BLKRASET,
+		          (unsigned long)(ra_saved[ra_nsaved].ra/512)) == -1)
+			fprintf(stderr, "BLKRASET: %s: %s\n",
+			        ra_saved[ra_nsaved].filename, strerror(errno));
+		if (fd != -1) close(fd);
+	}
+}
+
+/* Set the -a readahead of filename if it is a block device not already
+   set, and note its old value in ra_saved */
+static void apply_readahead(const struct diffcount_ctl *dc,
+                            const char *filename)
+{
+	struct stat sb;
+	unsigned i;
+
+	if (dc->readahead == 0 || stat(filename, &sb) != 0 ||
+	    !S_ISBLK(sb.st_mode))
+		return;
+	for (i = 0; i < ra_nsaved; i++)
+		if (ra_saved[i].rdev == sb.st_rdev) return;
+	if (ra_nsaved == 0) atexit(restore_readahead);
+	ra_saved[ra_nsaved].filename = filename;
+	ra_saved[ra_nsaved].rdev = sb.st_rdev;
+	ra_saved[ra_nsaved].ra = set_readahead(filename, dc->readahead);
+	ra_nsaved++;
+}
+
+/* Fit read sizes and alignment to the sector sizes of block device
+   inputs: direct I/O must be aligned to the logical sector size, and reads
+   are best done in whole physical sectors */
+static void fit_blockdev(struct diffcount_ctl *dc, const char *filename)
+{
+	unsigned physical;
+	int logical;
+
+	if (!is_blockdev(filename)) return;
+	get_sectors(filename, &logical, &physical);
+	if ((size_t)logical > dc->align) dc->align = logical;
+	if (physical != 0 && dc->bufsize % physical != 0)
+		dc->bufsize = (dc->bufsize/physical + 1)*physical;
+}
+
+/* Nonzero if filename can be opened and seeked */
+static int is_seekable(const char *filename)
+{
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) return 0;
+	ret = lseek(fd, 0, SEEK_CUR) != -1;
+	close(fd);
+	return ret;
+}
+
+/* Nonzero if filename is a regular file */
+static int is_regular(const char *filename)
+{
+	struct stat sb;
+
+	return stat(filename, &sb) == 0 && S_ISREG(sb.st_mode);
+}
+
+/* Nonzero if get_filesize() gives the size of filename's contents */
+static int known_size(const char *filename)
+{
+	return is_regular(filename) || is_blockdev(filename);
+}
+
+/* Number of bytes to request next, given the range length (zero for
+   unlimited), the bytes already delivered and the largest block size */
+static size_t next_len(unsigned long long len, unsigned long long pos,
+                       size_t max)
+{
+	if ((len != 0) && (len - pos) < max) return (size_t)(len - pos);
+	return max;
+}
+
+/*
+ * Direct I/O
+ *
+ * With -D, inputs are opened with O_DIRECT so that huge compares don't
+ * evict everything else from the page cache. O_DIRECT needs offsets,
+ * lengths and buffers aligned to dc->align, so each block is read as the
+ * aligned range covering it, and compared from the right place in the
+ * buffer. Where O_DIRECT is refused, the input is read normally and dropped
+ * from the page cache behind the read cursor instead.
+ */
+
+/* Size of each read buffer, with room for aligning direct reads */
+static size_t io_bufsize(const struct diffcount_ctl *dc)
+{
+	return dc->bufsize + (dc->direct ? 2*dc->align : 0);
+}
+
+/* Open an input for reading. With -D, try O_DIRECT first, and set *direct
+   if that worked. */
+static int open_input(const struct diffcount_ctl *dc, const char *filename,
+                      int *direct)
+{
+	int fd;
+
+	*direct = 0;
+	if (dc->direct) {
+		fd = open(filename, O_RDONLY | O_DIRECT);
+		if (fd != -1) {
+			*direct = 1;
+			return fd;
+		}
+	}
+	return open_or_die(filename, O_RDONLY);
+}
+
+/* Read up to len bytes at off, stopping early only at EOF */
+static size_t pread_full(int fd, const char *fname, uint8_t *buf, size_t len,
+                         unsigned long long off)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, off + done);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret == -1) {
+			fprintf(stderr, "pread %s: %s\n", fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+		if (ret == 0) break;
+		done += ret;
+	}
+	return done;
+}
+
+/* Write all len bytes of buf to fd, at off with pwrite when seq is zero */
+static void write_full(int fd, const char *fname, const uint8_t *buf,
+                       size_t len, unsigned long long off, int seq)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (seq)
+			ret = write(fd, buf + done, len - done);
+		else
+			ret = pwrite(fd, buf + done, len - done, off + done);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret == -1) {
+			fprintf(stderr, "write %s: %s\n", fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+		done += ret;
+	}
+}
+
+/* Offset into an aligned read at which off starts */
+static size_t direct_skip(size_t align, unsigned long long off)
+{
+	return off % align;
+}
+
+/* Length of the aligned read covering len bytes skip bytes in */
+static size_t direct_len(size_t align, size_t skip, size_t len)
+{
+	return (skip + len + align - 1)/align*align;
+}
+
+/* Read len bytes at off into buf and point *data at them. With a nonzero
+   align, the range covering them aligned to that is read instead, as
+   needed for O_DIRECT. Returns the number of bytes at *data, fewer than len
+   only at EOF. */
+static size_t read_at(int fd, const char *fname, size_t align, uint8_t *buf,
+                      size_t len, unsigned long long off,
+                      const uint8_t **data)
+{
+	size_t skip;
+	ssize_t ret;
+
+	*data = buf;
+	if (align == 0) return pread_full(fd, fname, buf, len, off);
+
+	/* A direct read can't be continued at an unaligned offset, and
+	   only comes up short at EOF */
+	skip = direct_skip(align, off);
+	do {
+		ret = pread(fd, buf, direct_len(align, skip, len), off - skip);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		fprintf(stderr, "pread %s: %s\n", fname, strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	*data = buf + skip;
+	if ((size_t)ret <= skip) return 0;
+	return (size_t)ret - skip < len ? (size_t)ret - skip : len;
+}
+
+/* Drop pages behind the read cursor pos from the page cache. *dropped is
+   the offset up to which that has been done. Pages are dropped in whole
+   DROP_STRIDE steps, since a large folio is only dropped if the range
+   covers all of it. */
+static void drop_behind(int fd, unsigned long long *dropped,
+                        unsigned long long pos)
+{
+	unsigned long long end = pos / DROP_STRIDE * DROP_STRIDE;
+
+	if (end <= *dropped) return;
+	posix_fadvise(fd, *dropped, end - *dropped, POSIX_FADV_DONTNEED);
+	*dropped = end;
+}
+
+/* Drop everything from *dropped up to and just past pos, once done
+   reading */
+static void drop_rest(int fd, unsigned long long *dropped,
+                      unsigned long long pos)
+{
+	posix_fadvise(fd, *dropped, pos + DROP_STRIDE - *dropped,
+	              POSIX_FADV_DONTNEED);
+}
+
+/* Starting value of *dropped for a read cursor at off */
+static unsigned long long drop_start(unsigned long long off)
+{
+	return off / DROP_STRIDE * DROP_STRIDE;
+}
+
+/*
+ * Read ring
+ *
+ * A reader thread fills a ring of buffer pairs while the compare thread
+ * consumes them, so that total time approaches the larger of the I/O and
+ * compute time instead of their sum. With a depth of one, buffers are
+ * filled synchronously on the compare thread instead.
+ */
+
+struct ring_slot {
+	uint8_t *buf_1, *buf_2;      /* Buffers of io_bufsize() bytes */
+	const uint8_t *p1, *p2;      /* Data to compare, within the buffers */
+	size_t fill;
+};
+
+/* Read the next bytes of each input into slot->buf_1 and slot->buf_2, and
+   point slot->p1 and slot->p2 at them. Returns the number of bytes ready
+   in both, zero when done. */
+typedef size_t (*ring_fill_fn)(void *arg, struct ring_slot *slot);
+
+struct ring {
+	struct ring_slot *slots;
+	unsigned depth;
+	unsigned head;               /* Next slot for the reader to fill */
+	unsigned tail;               /* Next slot for the consumer */
+	unsigned count;              /* Filled slots, including a held one */
+	int held;                    /* Consumer holds the tail slot */
+	int done;                    /* Reader reached the end */
+	int stop;                    /* Consumer asked the reader to stop */
+	ring_fill_fn fill;
+	void *arg;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *ring_reader(void *arg)
+{
+	struct ring *r = arg;
+	struct ring_slot *slot;
+	size_t fill;
+
+	pthread_mutex_lock(&r->lock);
+	while (1) {
+		while (r->count == r->depth && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop) break;
+		slot = &r->slots[r->head];
+		pthread_mutex_unlock(&r->lock);
+
+		fill = r->fill(r->arg, slot);
+
+		pthread_mutex_lock(&r->lock);
+		if (fill == 0) {
+			r->done = 1;
+			pthread_cond_broadcast(&r->cond);
+			break;
+		}
+		slot->fill = fill;
+		r->head = (r->head + 1) % r->depth;
+		r->count++;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+/* Set up a ring of dc->ring_depth pairs of io_bufsize() buffers. In constant
+   mode there is no second buffer, and p2 stays NULL. */
+static struct ring *ring_open(const struct diffcount_ctl *dc,
+                              ring_fill_fn fill, void *arg)
+{
+	struct ring *r;
+	unsigned i;
+	int err;
+
+	r = malloc_or_die(sizeof(struct ring));
+	r->depth = dc->ring_depth;
+	r->slots = malloc_or_die(r->depth*sizeof(struct ring_slot));
+	for (i = 0; i < r->depth; i++) {
+		r->slots[i].buf_1 = aligned_malloc_or_die(io_bufsize(dc));
+		r->slots[i].buf_2 = NULL;
+		if (dc->cmp_mode == CMP_FILE)
+			r->slots[i].buf_2 =
+				aligned_malloc_or_die(io_bufsize(dc));
+		r->slots[i].p1 = r->slots[i].buf_1;
+		r->slots[i].p2 = r->slots[i].buf_2;
+	}
+	r->head = r->tail = r->count = 0;
+	r->held = r->done = r->stop = 0;
+	r->fill = fill;
+	r->arg = arg;
+
+	if (r->depth > 1) {
+		pthread_mutex_init(&r->lock, NULL);
+		pthread_cond_init(&r->cond, NULL);
+		err = pthread_create(&r->thread, NULL, ring_reader, r);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	return r;
+}
+
+/* Get the next filled pair. The previous pair goes back to the reader. */
+static size_t ring_next(struct ring *r, const uint8_t **p1,
+                        const uint8_t **p2)
+{
+	struct ring_slot *slot;
+
+	if (r->depth == 1) {
+		slot = &r->slots[0];
+		slot->fill = r->fill(r->arg, slot);
+		*p1 = slot->p1;
+		*p2 = slot->p2;
+		return slot->fill;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	if (r->held) {
+		r->tail = (r->tail + 1) % r->depth;
+		r->count--;
+		r->held = 0;
+		pthread_cond_broadcast(&r->cond);
+	}
+	while (r->count == 0 && !r->done)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (r->count == 0) {
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+	slot = &r->slots[r->tail];
+	r->held = 1;
+	pthread_mutex_unlock(&r->lock);
+
+	*p1 = slot->p1;
+	*p2 = slot->p2;
+	return slot->fill;
+}
+
+static void ring_close(struct ring *r)
+{
+	unsigned i;
+
+	if (r->depth > 1) {
+		pthread_mutex_lock(&r->lock);
+		r->stop = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->cond);
+	}
+	for (i = 0; i < r->depth; i++) {
+		free(r->slots[i].buf_1);
+		free(r->slots[i].buf_2);
+	}
+	free(r->slots);
+	free(r);
+}
+
+/*
+ * stdio engine
+ *
+ * Copies both inputs through fread into the read ring. Works on anything
+ * that can be opened, including pipes and character devices.
+ */
+
+struct stdio_state {
+	const struct diffcount_ctl *dc;
+	FILE *stream_1, *stream_2;
+	struct ring *ring;
+	unsigned long long off_1;    /* Starting offset in file 1 */
+	unsigned long long off_2;    /* Starting offset in file 2 */
+	unsigned long long dropped_1, dropped_2; /* See drop_behind() */
+	unsigned long long len;      /* Bytes to compare, zero for EOF */
+	unsigned long long pos;      /* Bytes read so far */
+};
+
+/* Fill buffers. Returns the number of bytes that are ready to be compared
+   in the two buffers. */
+static size_t fill_buffers(FILE *stream_1, FILE *stream_2,
+			   uint8_t *buf_1, uint8_t *buf_2,
+                           size_t read_size)
+{
+	size_t buf1_fill, buf2_fill;
+
+	buf1_fill = fread(buf_1, 1, read_size, stream_1);
+	buf2_fill = fread(buf_2, 1, read_size, stream_2);
+
+	/* Return the lesser of the number of bytes that we
+	   successfuly read from each of the two streams. */
+	return buf1_fill < buf2_fill ? buf1_fill : buf2_fill;
+}
+
+/* Account for fill bytes just read */
+static size_t stdio_advance(struct stdio_state *st, size_t fill)
+{
+	st->pos += fill;
+	if (st->dc->direct) {
+		drop_behind(fileno(st->stream_1), &st->dropped_1,
+		            st->off_1 + st->pos);
+		if (st->stream_2 != NULL)
+			drop_behind(fileno(st->stream_2), &st->dropped_2,
+			            st->off_2 + st->pos);
+	}
+	return fill;
+}
+
+static size_t stdio_fill(void *arg, struct ring_slot *slot)
+{
+	struct stdio_state *st = arg;
+
+	return stdio_advance(st, fill_buffers(st->stream_1, st->stream_2,
+	                     slot->buf_1, slot->buf_2,
+	                     next_len(st->len, st->pos, st->dc->bufsize)));
+}
+
+/* In const mode, buffer count is whatever we managed to read from the
+   first stream */
+static size_t stdio_fill_const(void *arg, struct ring_slot *slot)
+{
+	struct stdio_state *st = arg;
+
+	return stdio_advance(st, fread(slot->buf_1, 1,
+	                     next_len(st->len, st->pos, st->dc->bufsize),
+	                     st->stream_1));
+}
+
+static void *stdio_open(const struct diffcount_ctl *dc,
+                        unsigned long long off_1, unsigned long long off_2,
+                        unsigned long long len)
+{
+	struct stdio_state *st;
+
+	st = malloc_or_die(sizeof(struct stdio_state));
+	st->dc = dc;
+	st->len = len;
+	st->pos = 0;
+	st->off_1 = off_1;
+	st->off_2 = off_2;
+	st->dropped_1 = drop_start(off_1);
+	st->dropped_2 = drop_start(off_2);
+	st->stream_1 = fopen_and_seek(dc->fname_1, off_1);
+	st->stream_2 = NULL;
+	if (dc->cmp_mode == CMP_FILE) {
+		st->stream_2 = fopen_and_seek(dc->fname_2, off_2);
+		st->ring = ring_open(dc, stdio_fill, st);
+	} else {
+		st->ring = ring_open(dc, stdio_fill_const, st);
+	}
+
+	return st;
+}
+
+static size_t stdio_next(void *state, const uint8_t **p1, const uint8_t **p2)
+{
+	struct stdio_state *st = state;
+
+	return ring_next(st->ring, p1, p2);
+}
+
+static void stdio_close(void *state)
+{
+	struct stdio_state *st = state;
+
+	ring_close(st->ring);
+	if (st->dc->direct) {
+		drop_rest(fileno(st->stream_1), &st->dropped_1,
+		          st->off_1 + st->pos);
+		if (st->stream_2 != NULL)
+			drop_rest(fileno(st->stream_2), &st->dropped_2,
+			          st->off_2 + st->pos);
+	}
+	fclose(st->stream_1);
+	if (st->stream_2 != NULL) fclose(st->stream_2);
+	free(st);
+}
+
+/*
+ * pread engine
+ *
+ * Like the stdio engine, but with positional reads on private file
+ * descriptors. Needs seekable inputs, and is what lets several compare
+ * threads work on one pair of files.
+ */
+
+struct pread_state {
+	const struct diffcount_ctl *dc;
+	int fd_1, fd_2;
+	int direct_1, direct_2;      /* Files opened with O_DIRECT */
+	unsigned long long off_1;    /* Next offset to read in file 1 */
+	unsigned long long off_2;    /* Next offset to read in file 2 */
+	unsigned long long dropped_1, dropped_2; /* See drop_behind() */
+	struct ring *ring;
+	unsigned long long len;      /* Bytes to compare, zero for EOF */
+	unsigned long long pos;      /* Bytes read so far */
+};
+
+static size_t pread_fill(void *arg, struct ring_slot *slot)
+{
+	struct pread_state *st = arg;
+	const struct diffcount_ctl *dc = st->dc;
+	size_t fill, fill_2;
+
+	fill = read_at(st->fd_1, dc->fname_1,
+	               st->direct_1 ? dc->align : 0, slot->buf_1,
+	               next_len(st->len, st->pos, dc->bufsize), st->off_1,
+	               &slot->p1);
+	if (dc->cmp_mode == CMP_FILE) {
+		fill_2 = read_at(st->fd_2, dc->fname_2,
+		                 st->direct_2 ? dc->align : 0, slot->buf_2,
+		                 fill, st->off_2, &slot->p2);
+		if (fill_2 < fill) fill = fill_2;
+	}
+	st->off_1 += fill;
+	st->off_2 += fill;
+	if (dc->direct && !st->direct_1)
+		drop_behind(st->fd_1, &st->dropped_1, st->off_1);
+	if (dc->direct && st->fd_2 != -1 && !st->direct_2)
+		drop_behind(st->fd_2, &st->dropped_2, st->off_2);
+	st->pos += fill;
+	return fill;
+}
+
+static void *pread_open(const struct diffcount_ctl *dc,
+                        unsigned long long off_1, unsigned long long off_2,
+                        unsigned long long len)
+{
+	struct pread_state *st;
+
+	st = malloc_or_die(sizeof(struct pread_state));
+	st->dc = dc;
+	st->len = len;
+	st->pos = 0;
+	st->off_1 = off_1;
+	st->off_2 = off_2;
+	st->dropped_1 = drop_start(off_1);
+	st->dropped_2 = drop_start(off_2);
+	st->fd_1 = open_input(dc, dc->fname_1, &st->direct_1);
+	st->fd_2 = -1;
+	if (dc->cmp_mode == CMP_FILE)
+		st->fd_2 = open_input(dc, dc->fname_2, &st->direct_2);
+	st->ring = ring_open(dc, pread_fill, st);
+
+	return st;
+}
+
+static size_t pread_next(void *state, const uint8_t **p1, const uint8_t **p2)
+{
+	struct pread_state *st = state;
+
+	return ring_next(st->ring, p1, p2);
+}
+
+static void pread_close(void *state)
+{
+	struct pread_state *st = state;
+
+	ring_close(st->ring);
+	if (st->dc->direct && !st->direct_1)
+		drop_rest(st->fd_1, &st->dropped_1, st->off_1);
+	if (st->dc->direct && st->fd_2 != -1 && !st->direct_2)
+		drop_rest(st->fd_2, &st->dropped_2, st->off_2);
+	close(st->fd_1);
+	if (st->fd_2 != -1) close(st->fd_2);
+	free(st);
+}
+
+static int pread_usable(const struct diffcount_ctl *dc)
+{
+	return is_seekable(dc->fname_1) &&
+	       (dc->cmp_mode == CMP_CONST || is_seekable(dc->fname_2));
+}
+
+/*
+ * io_uring engine
+ *
+ * Keeps reads of both files in flight at once through io_uring, one read
+ * per file for each of ring_depth buffer pairs. Buffers are registered
+ * with the kernel where possible. Uses the raw system calls, so no
+ * liburing is needed; when io_uring is not available, the pread engine is
+ * used instead.
+ */
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned to_submit;          /* SQEs queued but not yet submitted */
+};
+
+static int uring_setup(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd == -1) return -1;
+	u->entries = p.sq_entries;
+	u->to_submit = 0;
+
+	u->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) goto fail;
+	u->cq_ptr = u->sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_POPULATE, u->fd,
+		                 IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) goto fail;
+	}
+	u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto fail;
+
+	sq = u->sq_ptr;
+	cq = u->cq_ptr;
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	close(u->fd);
+	return -1;
+}
+
+static void uring_teardown(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_size);
+	munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+}
+
+/* Queue a read. The caller never has more than u->entries in flight, so
+   there is always room. */
+static void uring_read(struct uring *u, int fd, int buf_index, uint8_t *buf,
+                       size_t len, unsigned long long off, uint64_t data)
+{
+	unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+	sqe->user_data = data;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+/* Submit queued reads and wait for at least one completion. Returns the
+   completion, which must be released with uring_cqe_seen. */
+static struct io_uring_cqe *uring_wait(struct uring *u)
+{
+	unsigned head;
+	int ret;
+
+	while (1) {
+		head = *u->cq_head;
+		if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) &&
+		    u->to_submit == 0)
+			return &u->cqes[head & *u->cq_mask];
+		ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1,
+		              IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret == -1) {
+			perror("io_uring_enter");
+			exit(EXIT_TROUBLE);
+		}
+		u->to_submit -= ret;
+	}
+}
+
+static void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+struct uring_slot {
+	uint8_t *buf[2];
+	size_t want;                 /* Bytes requested from each file */
+	size_t skip[2];              /* Alignment bytes before the data */
+	size_t rlen[2];              /* Bytes to read into each buffer */
+	size_t got[2];               /* Bytes read into each buffer */
+	unsigned long long off;      /* Range offset of the block */
+	int pending;                 /* Reads in flight */
+};
+
+struct uring_state {
+	const struct diffcount_ctl *dc;
+	struct uring ring;
+	int nfiles;                  /* One in const mode, otherwise two */
+	int fd[2];
+	int direct[2];               /* Files opened with O_DIRECT */
+	const char *fname[2];
+	unsigned long long base[2];  /* File offsets of the range start */
+	unsigned long long dropped[2]; /* See drop_behind() */
+	struct uring_slot *slots;
+	unsigned depth;
+	unsigned tail;               /* Next slot to consume */
+	int held;                    /* Consumer holds the tail slot */
+	int ended;                   /* A short block was returned */
+	int fixed;                   /* Buffers are registered */
+	unsigned long long len;      /* Bytes to compare, zero for EOF */
+	unsigned long long issued;   /* Bytes requested so far */
+};
+
+static void uring_slot_read(struct uring_state *st, unsigned i, int f)
+{
+	struct uring_slot *slot = &st->slots[i];
+
+	uring_read(&st->ring, st->fd[f],
+	           st->fixed ? (int)(st->nfiles*i + f) : -1,
+	           slot->buf[f] + slot->got[f], slot->rlen[f] - slot->got[f],
+	           st->base[f] + slot->off - slot->skip[f] + slot->got[f],
+	           2*i + f);
+}
+
+/* Start reading the next block of the range into slot i */
+static void uring_slot_issue(struct uring_state *st, unsigned i)
+{
+	struct uring_slot *slot = &st->slots[i];
+	int f;
+
+	slot->want = next_len(st->len, st->issued, st->dc->bufsize);
+	slot->off = st->issued;
+	st->issued += slot->want;
+	slot->pending = 0;
+	for (f = 0; f < st->nfiles; f++) {
+		slot->got[f] = 0;
+		slot->skip[f] = 0;
+		slot->rlen[f] = slot->want;
+		if (st->direct[f]) {
+			slot->skip[f] = direct_skip(st->dc->align,
+			                            st->base[f] + slot->off);
+			slot->rlen[f] = direct_len(st->dc->align,
+			                           slot->skip[f], slot->want);
+		}
+		if (slot->want == 0) continue;
+		uring_slot_read(st, i, f);
+		slot->pending++;
+	}
+}
+
+/* Reap one completion, continuing short buffered reads that are not at
+   EOF */
+static void uring_reap(struct uring_state *st)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	unsigned i;
+	int f, res;
+
+	cqe = uring_wait(&st->ring);
+	i = cqe->user_data >> 1;
+	f = cqe->user_data & 1;
+	res = cqe->res;
+	uring_cqe_seen(&st->ring);
+
+	slot = &st->slots[i];
+	if (res == -EINTR || res == -EAGAIN) {
+		uring_slot_read(st, i, f);
+		return;
+	}
+	if (res < 0) {
+		fprintf(stderr, "io_uring read %s: %s\n", st->fname[f],
+		        strerror(-res));
+		exit(EXIT_TROUBLE);
+	}
+	slot->got[f] += res;
+	if (res > 0 && slot->got[f] < slot->rlen[f] && !st->direct[f])
+		uring_slot_read(st, i, f);
+	else
+		slot->pending--;
+}
+
+static int uring_available(void)
+{
+	struct uring u;
+
+	if (uring_setup(&u, 1) == -1) return 0;
+	uring_teardown(&u);
+	return 1;
+}
+
+static void *uring_open(const struct diffcount_ctl *dc,
+                        unsigned long long off_1, unsigned long long off_2,
+                        unsigned long long len)
+{
+	struct uring_state *st;
+	struct iovec *iov;
+	unsigned i;
+	int f;
+
+	st = malloc_or_die(sizeof(struct uring_state));
+	st->dc = dc;
+	st->len = len;
+	st->issued = 0;
+	st->tail = 0;
+	st->held = 0;
+	st->ended = 0;
+	st->depth = dc->ring_depth;
+	st->nfiles = dc->cmp_mode == CMP_FILE ? 2 : 1;
+	st->fname[0] = dc->fname_1;
+	st->fname[1] = dc->fname_2;
+	st->base[0] = off_1;
+	st->base[1] = off_2;
+	st->dropped[0] = drop_start(off_1);
+	st->dropped[1] = drop_start(off_2);
+	st->direct[0] = st->direct[1] = 0;
+	for (f = 0; f < st->nfiles; f++)
+		st->fd[f] = open_input(dc, st->fname[f], &st->direct[f]);
+
+	if (uring_setup(&st->ring, 2*st->depth) == -1) {
+		perror("io_uring_setup");
+		exit(EXIT_TROUBLE);
+	}
+
+	st->slots = malloc_or_die(st->depth*sizeof(struct uring_slot));
+	iov = malloc_or_die(st->nfiles*st->depth*sizeof(struct iovec));
+	for (i = 0; i < st->depth; i++) {
+		st->slots[i].buf[1] = NULL;
+		for (f = 0; f < st->nfiles; f++) {
+			st->slots[i].buf[f] =
+				aligned_malloc_or_die(io_bufsize(dc));
+			iov[st->nfiles*i + f].iov_base = st->slots[i].buf[f];
+			iov[st->nfiles*i + f].iov_len = io_bufsize(dc);
+		}
+	}
+	/* Registered buffers save a page walk per read, but are limited by
+	   RLIMIT_MEMLOCK, so carry on without them if that fails */
+	st->fixed = syscall(__NR_io_uring_register, st->ring.fd,
+	                    IORING_REGISTER_BUFFERS, iov,
+	                    st->nfiles*st->depth) == 0;
+	free(iov);
+
+	for (i = 0; i < st->depth; i++)
+		uring_slot_issue(st, i);
+
+	return st;
+}
+
+/* Bytes of the block available in buffer f of slot */
+static size_t uring_slot_avail(const struct uring_slot *slot, int f)
+{
+	if (slot->got[f] <= slot->skip[f]) return 0;
+	if (slot->got[f] - slot->skip[f] > slot->want) return slot->want;
+	return slot->got[f] - slot->skip[f];
+}
+
+static size_t uring_next(void *state, const uint8_t **p1, const uint8_t **p2)
+{
+	struct uring_state *st = state;
+	struct uring_slot *slot;
+	size_t fill;
+	int f;
+
+	if (st->ended) return 0;
+	if (st->held) {
+		slot = &st->slots[st->tail];
+		for (f = 0; f < st->nfiles; f++)
+			if (st->dc->direct && !st->direct[f])
+				drop_behind(st->fd[f], &st->dropped[f],
+				            st->base[f] + slot->off +
+				            slot->want);
+		uring_slot_issue(st, st->tail);
+		st->tail = (st->tail + 1) % st->depth;
+		st->held = 0;
+	}
+
+	slot = &st->slots[st->tail];
+	while (slot->pending > 0)
+		uring_reap(st);
+
+	fill = uring_slot_avail(slot, 0);
+	if (st->nfiles == 2 && uring_slot_avail(slot, 1) < fill)
+		fill = uring_slot_avail(slot, 1);
+	if (fill < slot->want || fill == 0) st->ended = 1;
+	st->held = 1;
+
+	*p1 = slot->buf[0] + slot->skip[0];
+	*p2 = st->nfiles == 2 ? slot->buf[1] + slot->skip[1] : NULL;
+	return fill;
+}
+
+static void uring_close(void *state)
+{
+	struct uring_state *st = state;
+	unsigned i;
+	int f;
+
+	/* Wait for reads still in flight before freeing their buffers */
+	for (i = 0; i < st->depth; i++)
+		while (st->slots[i].pending > 0)
+			uring_reap(st);
+
+	uring_teardown(&st->ring);
+	for (f = 0; f < st->nfiles; f++)
+		if (st->dc->direct && !st->direct[f])
+			drop_rest(st->fd[f], &st->dropped[f],
+			          st->base[f] + st->issued);
+	for (i = 0; i < st->depth; i++) {
+		free(st->slots[i].buf[0]);
+		free(st->slots[i].buf[1]);
+	}
+	for (f = 0; f < st->nfiles; f++)
+		close(st->fd[f]);
+	free(st->slots);
+	free(st);
+}
+
+static int uring_usable(const struct diffcount_ctl *dc)
+{
+	return pread_usable(dc) && uring_available();
+}
+
+/*
+ * mmap engine
+ *
+ * Compares straight out of the page cache. Each file is mapped through a
+ * sliding window of MMAP_WINDOW bytes, so files larger than the address
+ * space or RAM still work. Only regular files can be used.
+ */
+
+#ifndef MMAP_WINDOW
+#define MMAP_WINDOW (64UL << 20)
+#endif
+
+struct mmap_file {
+	const char *fname;
+	int fd;
+	unsigned long long size;     /* File size */
+	unsigned long long pos;      /* Current file offset */
+	uint8_t *map;                /* Current window, or NULL */
+	unsigned long long map_off;  /* File offset of the window */
+	size_t map_len;              /* Length of the window */
+};
+
+struct mmap_state {
+	struct mmap_file f_1, f_2;
+	int cmp_file;                /* Second input is a file */
+	unsigned long long len;      /* Bytes to compare, zero for EOF */
+	unsigned long long done;     /* Bytes delivered so far */
+};
+
+static void mmap_file_open(struct mmap_file *mf, const char *fname,
+                           unsigned long long off)
+{
+	struct stat sb;
+
+	mf->fname = fname;
+	mf->fd = open_or_die(fname, O_RDONLY);
+	if (fstat(mf->fd, &sb) == -1) {
+		fprintf(stderr, "fstat: %s: %s\n", fname, strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	mf->size = sb.st_size;
+	mf->pos = off;
+	mf->map = NULL;
+	mf->map_off = 0;
+	mf->map_len = 0;
+}
+
+static void mmap_file_unmap(struct mmap_file *mf)
+{
+	if (mf->map != NULL) munmap(mf->map, mf->map_len);
+	mf->map = NULL;
+}
+
+/* Number of mapped bytes available at mf->pos, remapping the window if
+   needed. Zero at EOF. */
+static size_t mmap_file_avail(struct mmap_file *mf)
+{
+	unsigned long long page = sysconf(_SC_PAGESIZE);
+
+	if (mf->pos >= mf->size) return 0;
+	if (mf->map == NULL || mf->pos >= mf->map_off + mf->map_len) {
+		mmap_file_unmap(mf);
+		mf->map_off = mf->pos & ~(page - 1);
+		mf->map_len = MMAP_WINDOW;
+		if (mf->map_off + mf->map_len > mf->size)
+			mf->map_len = mf->size - mf->map_off;
+		mf->map = mmap(NULL, mf->map_len, PROT_READ, MAP_SHARED,
+		               mf->fd, mf->map_off);
+		if (mf->map == MAP_FAILED) {
+			fprintf(stderr, "mmap %s: %s\n", mf->fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+		madvise(mf->map, mf->map_len, MADV_SEQUENTIAL);
+		madvise(mf->map, mf->map_len, MADV_WILLNEED);
+	}
+	return mf->map_off + mf->map_len - mf->pos;
+}
+
+static void *mmap_open(const struct diffcount_ctl *dc,
+                       unsigned long long off_1, unsigned long long off_2,
+                       unsigned long long len)
+{
+	struct mmap_state *st;
+
+	st = malloc_or_die(sizeof(struct mmap_state));
+	st->len = len;
+	st->done = 0;
+	st->cmp_file = dc->cmp_mode == CMP_FILE;
+	mmap_file_open(&st->f_1, dc->fname_1, off_1);
+	if (st->cmp_file)
+		mmap_file_open(&st->f_2, dc->fname_2, off_2);
+	return st;
+}
+
+static size_t mmap_next(void *state, const uint8_t **p1, const uint8_t **p2)
+{
+	struct mmap_state *st = state;
+	size_t n, avail;
+
+	n = next_len(st->len, st->done, MMAP_WINDOW);
+	avail = mmap_file_avail(&st->f_1);
+	if (avail < n) n = avail;
+	if (st->cmp_file) {
+		avail = mmap_file_avail(&st->f_2);
+		if (avail < n) n = avail;
+	}
+	if (n == 0) return 0;
+
+	*p1 = st->f_1.map + (st->f_1.pos - st->f_1.map_off);
+	st->f_1.pos += n;
+	if (st->cmp_file) {
+		*p2 = st->f_2.map + (st->f_2.pos - st->f_2.map_off);
+		st->f_2.pos += n;
+	}
+	st->done += n;
+	return n;
+}
+
+static void mmap_close(void *state)
+{
+	struct mmap_state *st = state;
+
+	mmap_file_unmap(&st->f_1);
+	close(st->f_1.fd);
+	if (st->cmp_file) {
+		mmap_file_unmap(&st->f_2);
+		close(st->f_2.fd);
+	}
+	free(st);
+}
+
+static int mmap_usable(const struct diffcount_ctl *dc)
+{
+	/* Mapped pages stay in the page cache */
+	if (dc->direct) return 0;
+	return is_regular(dc->fname_1) &&
+	       (dc->cmp_mode == CMP_CONST || is_regular(dc->fname_2));
+}
+
+static int always_usable(const struct diffcount_ctl *dc)
+{
+	(void)dc;
+	return 1;
+}
+
+/* Available engines, in order of preference for auto */
+static const struct diff_engine diff_engines[] = {
+	{ "mmap",  mmap_usable,   mmap_open,  mmap_next,  mmap_close,  NULL },
+	{ "pread", pread_usable,  pread_open, pread_next, pread_close, NULL },
+	{ "stdio", always_usable, stdio_open, stdio_next, stdio_close, NULL },
+	/* Not picked by auto: the other engines are as fast for cached
+	   data, and this one only pays off with a deep queue */
+	{ "uring", uring_usable,  uring_open, uring_next, uring_close,
+	  "pread" },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/* Look up an engine by name. "auto" picks the first one usable with the
+   inputs in dc. */
+static const struct diff_engine *select_engine(const struct diffcount_ctl *dc,
+                                               const char *name)
+{
+	const struct diff_engine *e;
+
+	for (e = diff_engines; e->name != NULL; e++) {
+		if (strcmp(name, "auto") != 0 && strcmp(name, e->name) != 0)
+			continue;
+		if (e->usable(dc)) return e;
+		if (strcmp(name, "auto") != 0 && e->fallback != NULL) {
+			fprintf(stderr, "engine %s: not usable, using %s\n",
+			        name, e->fallback);
+			return select_engine(dc, e->fallback);
+		}
+		if (strcmp(name, "auto") != 0) {
+			fprintf(stderr, "engine %s: not usable with these "
+			        "inputs\n", name);
+			exit(EXIT_TROUBLE);
+		}
+	}
+	fprintf(stderr, "engine %s: unknown\n", name);
+	exit(EXIT_TROUBLE);
+}
+
+/* Number of bytes a comparison of len bytes (zero for up to the first EOF)
+   at off_1 and off_2 will cover, from the input sizes */
+static unsigned long long compare_len(const struct diffcount_ctl *dc,
+                                      unsigned long long off_1,
+                                      unsigned long long off_2,
+                                      unsigned long long len)
+{
+	unsigned long long avail, size;
+
+	/* In whole bytes, which a realigned input has one fewer of */
+	size = get_filesize(dc->fname_1);
+	avail = size > off_1 ? size - off_1 : 0;
+	if (dc->bit_1 && avail != 0) avail--;
+	if (dc->cmp_mode == CMP_FILE) {
+		size = get_filesize(dc->fname_2);
+		size = size > off_2 ? size - off_2 : 0;
+		if (dc->bit_2 && size != 0) size--;
+		if (size < avail) avail = size;
+	}
+	/* The mask file is read at the offsets of file 1 */
+	if (dc->mask_fname != NULL) {
+		size = get_filesize(dc->mask_fname);
+		size = size > off_1 ? size - off_1 : 0;
+		if (size < avail) avail = size;
+	}
+	if (len != 0 && len < avail) avail = len;
+	return avail;
+}
+
+/*
+ * Windowed profile
+ *
+ * With -w, the compared range is cut into windows of a fixed size counted
+ * from seek1, and the bytes compared, bytes differing and bits differing
+ * in each window are written out as they complete. Blocks are split at
+ * window boundaries and each piece goes through the kernel as a whole, so
+ * a profile costs no more per byte than a plain compare.
+ *
+ * Each record is the window offset in file 1 followed by the three
+ * counts, either as a CSV line or as four native-endian 64-bit integers.
+ */
+
+#ifndef PROFILE_FLUSH
+#define PROFILE_FLUSH 4096           /* Windows buffered before writing */
+#endif
+
+struct profile_win {
+	unsigned long long comp_B;
+	unsigned long long diff_B;
+	unsigned long long diff_b;
+};
+
+struct profile {
+	const struct diffcount_ctl *dc;
+	unsigned long long size;     /* Window size */
+	unsigned long long first;    /* Index of the window in win[0] */
+	size_t n, cap;               /* Windows held, and allocated */
+	struct profile_win *win;
+	FILE *out;                   /* Output, or NULL to hold all windows */
+};
+
+static struct profile *profile_new(const struct diffcount_ctl *dc,
+                                   unsigned long long first, FILE *out)
+{
+	struct profile *prof;
+
+	prof = malloc_or_die(sizeof(struct profile));
+	prof->dc = dc;
+	prof->size = dc->window;
+	prof->first = first;
+	prof->n = 0;
+	prof->cap = PROFILE_FLUSH;
+	prof->win = malloc_or_die(prof->cap*sizeof(struct profile_win));
+	prof->out = out;
+	return prof;
+}
+
+static struct profile *profile_open(const struct diffcount_ctl *dc)
+{
+	FILE *out;
+
+	if (strcmp(dc->prof_fname, "-") == 0) {
+		out = stdout;
+	} else {
+		out = fopen(dc->prof_fname, dc->prof_binary ? "wb" : "w");
+		if (out == NULL) {
+			fprintf(stderr, "fopen: %s: %s\n", dc->prof_fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	if (!dc->prof_binary)
+		fprintf(out, "offset,compared_bytes,differ_bytes,"
+		        "differ_bits\n");
+	return profile_new(dc, 0, out);
+}
+
+/* Write out all but the last keep windows */
+static void profile_flush(struct profile *prof, size_t keep)
+{
+	const struct profile_win *w;
+	uint64_t rec[4];
+	size_t i;
+
+	for (i = 0; i + keep < prof->n; i++) {
+		w = &prof->win[i];
+		rec[0] = prof->dc->seek_1 + (prof->first + i)*prof->size;
+		if (prof->dc->prof_binary) {
+			rec[1] = w->comp_B;
+			rec[2] = w->diff_B;
+			rec[3] = w->diff_b;
+			fwrite(rec, sizeof(rec), 1, prof->out);
+		} else {
+			fprintf(prof->out, "%llu,%llu,%llu,%llu\n",
+			        (unsigned long long)rec[0], w->comp_B,
+			        w->diff_B, w->diff_b);
+		}
+	}
+	memmove(prof->win, prof->win + i, keep*sizeof(struct profile_win));
+	prof->first += i;
+	prof->n = keep;
+}
+
+/* Window idx, which must not have been written out yet. Windows complete
+   in order, so reaching a new window writes out all but the one before
+   it once enough have accumulated. */
+static struct profile_win *profile_at(struct profile *prof,
+                                      unsigned long long idx)
+{
+	while (idx >= prof->first + prof->n) {
+		if (prof->n == prof->cap) {
+			if (prof->out != NULL) {
+				profile_flush(prof, 1);
+			} else {
+				prof->cap *= 2;
+				prof->win = realloc(prof->win, prof->cap*
+				                    sizeof(struct profile_win));
+				if (prof->win == NULL) {
+					perror("realloc");
+					exit(EXIT_TROUBLE);
+				}
+			}
+		}
+		memset(&prof->win[prof->n++], 0, sizeof(struct profile_win));
+	}
+	return &prof->win[idx - prof->first];
+}
+
+/* Account for len bytes at pos, relative to seek1, that each differ in
+   diff_B bytes and diff_b bits */
+static void profile_uniform(struct profile *prof, unsigned long long pos,
+                            unsigned long long len, unsigned diff_B,
+                            unsigned diff_b)
+{
+	struct profile_win *w;
+	unsigned long long n;
+
+	while (len > 0) {
+		n = prof->size - pos % prof->size;
+		if (n > len) n = len;
+		w = profile_at(prof, pos/prof->size);
+		w->comp_B += n;
+		w->diff_B += n*diff_B;
+		w->diff_b += n*diff_b;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Add the windows of src into dst, and free src */
+static void profile_merge(struct profile *dst, struct profile *src)
+{
+	struct profile_win *w;
+	size_t i;
+
+	for (i = 0; i < src->n; i++) {
+		w = profile_at(dst, src->first + i);
+		w->comp_B += src->win[i].comp_B;
+		w->diff_B += src->win[i].diff_B;
+		w->diff_b += src->win[i].diff_b;
+	}
+	free(src->win);
+	free(src);
+}
+
+static void profile_close(struct profile *prof)
+{
+	profile_flush(prof, 0);
+	if (fflush(prof->out) != 0 || ferror(prof->out) ||
+	    (prof->out != stdout && fclose(prof->out) != 0)) {
+		fprintf(stderr, "write: %s: %s\n", prof->dc->prof_fname,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	free(prof->win);
+	free(prof);
+}
+
+/*
+ * Range list
+ *
+ * With -l, each run of differing bytes is written out as its offset in
+ * file 1, its length and the number of differing bits in it, merging runs
+ * separated by no more than the -g gap. Runs are found from the difference
+ * masks, so equal data costs one test per 64 bytes, and only the range in
+ * progress is kept, so memory use does not grow with the number of ranges.
+ */
+
+#ifndef RANGE_TILE
+#define RANGE_TILE 64                /* Masks computed at a time */
+#endif
+
+struct range_list {
+	const struct diffcount_ctl *dc;
+	FILE *out;
+	int open;                    /* A range is in progress */
+	unsigned long long start;    /* Range in progress, relative to seek1 */
+	unsigned long long end;
+	unsigned long long bits;     /* Differing bits in it */
+	unsigned long long count;    /* Ranges written */
+};
+
+static struct range_list *range_open(const struct diffcount_ctl *dc)
+{
+	struct range_list *rl;
+
+	rl = malloc_or_die(sizeof(struct range_list));
+	rl->dc = dc;
+	rl->open = 0;
+	rl->count = 0;
+	if (strcmp(dc->range_fname, "-") == 0) {
+		rl->out = stdout;
+	} else {
+		rl->out = fopen(dc->range_fname, "w");
+		if (rl->out == NULL) {
+			fprintf(stderr, "fopen: %s: %s\n", dc->range_fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	fprintf(rl->out, "offset,length,differ_bits\n");
+	return rl;
+}
+
+static void range_write(struct range_list *rl)
+{
+	fprintf(rl->out, "%llu,%llu,%llu\n", rl->dc->seek_1 + rl->start,
+	        rl->end - rl->start, rl->bits);
+	rl->count++;
+}
+
+/* Add len differing bytes at pos, relative to seek1, with bits differing
+   bits. Runs must be added in order. */
+static void range_add(struct range_list *rl, unsigned long long pos,
+                      unsigned long long len, unsigned long long bits)
+{
+	if (rl->open && pos - rl->end <= rl->dc->range_gap) {
+		rl->end = pos + len;
+		rl->bits += bits;
+		return;
+	}
+	if (rl->open) range_write(rl);
+	rl->open = 1;
+	rl->start = pos;
+	rl->end = pos + len;
+	rl->bits = bits;
+}
+
+/* Write out the range in progress and close the list. Returns the number
+   of ranges written. */
+static unsigned long long range_close(struct range_list *rl)
+{
+	unsigned long long count;
+
+	if (rl->open) range_write(rl);
+	if (fflush(rl->out) != 0 || ferror(rl->out) ||
+	    (rl->out != stdout && fclose(rl->out) != 0)) {
+		fprintf(stderr, "write: %s: %s\n", rl->dc->range_fname,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	count = rl->count;
+	free(rl);
+	return count;
+}
+
+/*
+ * Masks
+ *
+ * A mask file is read alongside the inputs through an engine instance of
+ * its own, with its own read buffers, and a mask pattern is repeated in a
+ * buffer of PATTERN_TILE bytes and one more period, which stays in cache.
+ * Either way, the mask byte for each byte compared is the one at the same
+ * offset in file 1.
+ */
+
+struct mask_cursor {
+	const struct diffcount_ctl *dc;
+	struct diffcount_ctl mc;     /* dc, reading the mask file as file 1 */
+	void *st;                    /* Engine state, or NULL for a pattern */
+	const uint8_t *p;            /* Current block of the mask file */
+	size_t fill;                 /* Bytes in it, */
+	size_t used;                 /* and used so far */
+};
+
+/* Start reading the mask for len bytes at off in file 1, or return NULL
+   without a mask */
+static struct mask_cursor *mask_open(const struct diffcount_ctl *dc,
+                                     unsigned long long off,
+                                     unsigned long long len)
+{
+	struct mask_cursor *c;
+
+	if (dc->mask_fname == NULL && dc->mask_pat == NULL) return NULL;
+	c = malloc_or_die(sizeof(struct mask_cursor));
+	c->dc = dc;
+	c->st = NULL;
+	c->fill = c->used = 0;
+	if (dc->mask_fname != NULL) {
+		c->mc = *dc;
+		c->mc.fname_1 = (char *)dc->mask_fname;
+		c->mc.fname_2 = NULL;
+		c->mc.cmp_mode = CMP_CONST;
+		/* The mask may be a different kind of file from file 1 */
+		c->mc.engine = dc->engine->usable(&c->mc) ? dc->engine :
+		               select_engine(&c->mc, "pread");
+		c->st = c->mc.engine->open(&c->mc, off, 0, len);
+	}
+	return c;
+}
+
+/* Point *pm at up to len bytes of mask for file 1 offset off, which must
+   follow on from the last call for a mask file. Returns how many. */
+static size_t mask_get(struct mask_cursor *c, unsigned long long off,
+                       size_t len, const uint8_t **pm)
+{
+	const uint8_t *unused;
+
+	if (c->st == NULL) {
+		*pm = c->dc->mask_pat + off % c->dc->mask_period;
+		return len < PATTERN_TILE ? len : PATTERN_TILE;
+	}
+	if (c->used == c->fill) {
+		c->fill = c->mc.engine->next(c->st, &c->p, &unused);
+		c->used = 0;
+		if (c->fill == 0) {
+			fprintf(stderr, "%s: mask ended early\n",
+			        c->dc->mask_fname);
+			exit(EXIT_TROUBLE);
+		}
+	}
+	*pm = c->p + c->used;
+	if (c->fill - c->used < len) len = c->fill - c->used;
+	c->used += len;
+	return len;
+}
+
+static void mask_close(struct mask_cursor *c)
+{
+	if (c == NULL) return;
+	if (c->st != NULL) c->mc.engine->close(c->st);
+	free(c);
+}
+
+/*
+ * References
+ *
+ * In constant mode, file 1 can be compared against a repeating pattern of
+ * bytes or a generated sequence of little-endian words instead of a single
+ * byte. Patterns are read from a buffer built by tile_pattern(), and words
+ * are generated a tile at a time into a buffer on the stack, so the
+ * reference never takes more than PATTERN_TILE bytes plus a period of cache
+ * and is never read from anywhere. Like masks, the reference is indexed by
+ * file 1 offset: a pattern is repeated from the start of file 1, and word k
+ * of file 1 holds k, or its offset k*width.
+ */
+
+union ref_tile {
+	uint8_t b[PATTERN_TILE + 8];
+	uint16_t h[PATTERN_TILE/2 + 4];
+	uint32_t w[PATTERN_TILE/4 + 2];
+	uint64_t q[PATTERN_TILE/8 + 1];
+};
+
+/* Generate words [first, first + n) of the reference into t */
+#define REF_FILL(arr, type) do {                                        \
+	for (i = 0; i < n; i++)                                         \
+		t->arr[i] = (type)(dc->ref == REF_ADDR ?                \
+		                   (first + i)*sizeof(type) : first + i); \
+} while (0)
+
+/* Reference for len bytes, at most PATTERN_TILE, at file 1 offset off,
+   generating them in t if needed */
+static const uint8_t *ref_get(const struct diffcount_ctl *dc,
+                              unsigned long long off, size_t len,
+                              union ref_tile *t)
+{
+	const unsigned w = dc->ref_width;
+	unsigned long long first;
+	size_t i, n;
+
+	if (dc->ref == REF_PATTERN)
+		return dc->ref_pat + off % dc->ref_period;
+	first = off/w;
+	n = (off % w + len + w - 1)/w;
+	switch (w) {
+	case 1: REF_FILL(b, uint8_t); break;
+	case 2: REF_FILL(h, uint16_t); break;
+	case 4: REF_FILL(w, uint32_t); break;
+	default: REF_FILL(q, uint64_t); break;
+	}
+	return t->b + off % w;
+}
+
+#undef REF_FILL
+
+/*
+ * LFSR references
+ *
+ * PRBS and other LFSR references come from a Fibonacci LFSR, most
+ * significant bit of each byte first, and start at seek1. The register
+ * holds the last n bits, s[t - k] in bit k - 1, and the taps have bit k - 1
+ * set for each term x^k of the polynomial other than 1.
+ *
+ * Stepping the register a bit at a time could not keep up with the
+ * kernels. But over GF(2), raising the polynomial to the 64th power just
+ * raises its terms to it, so a sequence with s[t] the XOR of s[t - k] over
+ * the taps also has s[t] the XOR of s[t - 64k]: each 64-bit word is the
+ * XOR of the words k back. Squaring again doubles the lags, until runs
+ * of at least LFSR_RUN words, as many as the smallest lag, have no
+ * dependences and vectorize. From the history of the words the largest
+ * lag back, the rest of the sequence follows a run at a time. The history
+ * at any offset comes from jumping the register there with powers of its
+ * companion matrix, and then stepping it bit by bit.
+ */
+
+#define LFSR_MAX 63                  /* Longest register */
+#define LFSR_RUN 32                  /* Shortest run of words */
+#define LFSR_TRIES 8                 /* Seeds tried when synchronizing */
+
+struct lfsr_gen {
+	const struct diffcount_ctl *dc;
+	unsigned lags[LFSR_MAX];     /* Words back of each tap, rising */
+	unsigned ntaps;
+	unsigned hist;               /* Words of history, the largest lag */
+	int valid;                   /* w holds a stretch of the sequence */
+	unsigned long long first;    /* Word index of w[hist] */
+	size_t count;                /* Words generated from w[hist] on */
+	uint64_t w[LFSR_MAX*LFSR_RUN + PATTERN_TILE/8 + 2];
+	uint64_t inv[PATTERN_TILE/8 + 2]; /* Inverted words, with lfsr_inv */
+};
+
+/* Step the register and return the new bit */
+static inline unsigned lfsr_step(uint64_t *reg, uint64_t taps, unsigned n)
+{
+	unsigned b = __builtin_parityll(*reg & taps);
+
+	*reg = (*reg << 1 | b) & ((1ULL << n) - 1);
+	return b;
+}
+
+/* The register a bit earlier. The term x^n always has a tap, so the bit
+   shifted out is the XOR of the newest bit and the other taps. */
+static uint64_t lfsr_back(uint64_t reg, uint64_t taps, unsigned n)
+{
+	uint64_t old;
+
+	old = (reg & 1) ^ __builtin_parityll((reg >> 1) & taps);
+	return reg >> 1 | old << (n - 1);
+}
+
+/* Product of the GF(2) matrix with columns cols and v */
+static uint64_t gf2_apply(const uint64_t *cols, uint64_t v)
+{
+	uint64_t r = 0;
+
+	for (; v != 0; v &= v - 1)
+		r ^= cols[__builtin_ctzll(v)];
+	return r;
+}
+
+/* The register count bits later */
+static uint64_t lfsr_jump(uint64_t reg, uint64_t taps, unsigned n,
+                          unsigned long long count)
+{
+	uint64_t m[LFSR_MAX], sq[LFSR_MAX];
+	unsigned j;
+
+	/* Companion matrix: the new bit 0 is the parity of the taps, and
+	   every other bit moves up one */
+	for (j = 0; j < n; j++)
+		m[j] = (taps >> j & 1) | (j + 1 < n ? 2ULL << j : 0);
+	for (; count != 0; count >>= 1) {
+		if (count & 1) reg = gf2_apply(m, reg);
+		for (j = 0; j < n; j++)
+			sq[j] = gf2_apply(m, m[j]);
+		memcpy(m, sq, n*sizeof(uint64_t));
+	}
+	return reg;
+}
+
+static struct lfsr_gen *lfsr_open(const struct diffcount_ctl *dc)
+{
+	struct lfsr_gen *g;
+	unsigned k, scale;
+
+	if (dc->ref != REF_LFSR) return NULL;
+	g = malloc_or_die(sizeof(struct lfsr_gen));
+	g->dc = dc;
+	g->valid = 0;
+	g->ntaps = 0;
+	for (k = 1; k <= dc->lfsr_len; k++)
+		if (dc->lfsr_taps >> (k - 1) & 1) g->lags[g->ntaps++] = k;
+	k = __builtin_ctzll(dc->lfsr_taps) + 1;
+	for (scale = 1; k*scale < LFSR_RUN; scale <<= 1);
+	for (k = 0; k < g->ntaps; k++)
+		g->lags[k] *= scale;
+	g->hist = dc->lfsr_len*scale;
+	return g;
+}
+
+/* Fill the history with the words before word i */
+static void lfsr_seek(struct lfsr_gen *g, unsigned long long i)
+{
+	const unsigned n = g->dc->lfsr_len, h = g->hist;
+	const uint64_t taps = g->dc->lfsr_taps;
+	uint64_t reg = g->dc->lfsr_seed;
+	uint8_t *b = (uint8_t *)g->w, byte;
+	unsigned long long k;
+	unsigned j;
+
+	if (i >= h) {
+		reg = lfsr_jump(reg, taps, n, 64*(i - h));
+	} else {
+		for (k = 0; k < 64*(h - i); k++)
+			reg = lfsr_back(reg, taps, n);
+	}
+	for (k = 0; k < 8*h; k++) {
+		byte = 0;
+		for (j = 0; j < 8; j++)
+			byte = byte << 1 | lfsr_step(&reg, taps, n);
+		b[k] = byte;
+	}
+	g->first = i;
+	g->count = 0;
+	g->valid = 1;
+}
+
+static void xor_words(uint64_t *restrict dst, const uint64_t *restrict a,
+                      const uint64_t *restrict b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = a[i] ^ b[i];
+}
+
+static void xor_into(uint64_t *restrict dst, const uint64_t *restrict a,
+                     size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] ^= a[i];
+}
+
+/* The len bytes, at most PATTERN_TILE, of the sequence at pos, relative to
+   seek1. They stay valid until the next call. */
+static const uint8_t *lfsr_get(struct lfsr_gen *g, unsigned long long pos,
+                               size_t len)
+{
+	const unsigned h = g->hist;
+	unsigned long long i = pos/8;
+	size_t count = (pos % 8 + len + 7)/8, j, step, k;
+
+	/* Reads are mostly in order, so the history is usually at hand */
+	if (g->valid && i >= g->first && i <= g->first + g->count) {
+		memmove(g->w, g->w + (i - g->first), h*sizeof(uint64_t));
+		g->first = i;
+	} else {
+		lfsr_seek(g, i);
+	}
+
+	for (j = h; j < h + count; j += step) {
+		step = h + count - j < g->lags[0] ? h + count - j : g->lags[0];
+		if (g->ntaps == 1)
+			memcpy(g->w + j, g->w + j - g->lags[0],
+			       step*sizeof(uint64_t));
+		else
+			xor_words(g->w + j, g->w + j - g->lags[0],
+			          g->w + j - g->lags[1], step);
+		for (k = 2; k < g->ntaps; k++)
+			xor_into(g->w + j, g->w + j - g->lags[k], step);
+	}
+	g->count = count;
+
+	if (!g->dc->lfsr_inv) return (const uint8_t *)(g->w + h) + pos % 8;
+	for (j = 0; j < count; j++)
+		g->inv[j] = ~g->w[h + j];
+	return (const uint8_t *)g->inv + pos % 8;
+}
+
+/* Compare len bytes, counting only the bits set in pm when that is not
+   NULL */
+static inline void compare_kernel(const struct diffcount_ctl *dc,
+                                  const uint8_t *p1, const uint8_t *p2,
+                                  const uint8_t *pm, size_t len,
+                                  struct diffcount_res *dr)
+{
+	if (pm != NULL)
+		dc->kernel->mask_fn(p1, p2, pm, dc->const_val, len, dr);
+	else if (p2 == NULL)
+		dc->kernel->const_fn(p1, len, dc->const_val, dr);
+	else
+		dc->kernel->fn(p1, p2, len, dr);
+}
+
+/* Add len bytes at pos, relative to seek1, that all differ from zero by
+   the bits of c to the bit position histogram */
+static void lanes_uniform(struct diffcount_res *dr, unsigned long long pos,
+                          unsigned long long len, uint8_t c)
+{
+	unsigned long long n;
+	unsigned b, k;
+
+	for (b = 0; b < 8; b++) {
+		/* Bytes in [pos, pos + len) that are byte b of a word */
+		n = (pos + len)/8 + (b < (pos + len) % 8) -
+		    pos/8 - (b < pos % 8);
+		for (k = 0; k < 8; k++)
+			if (c & (1 << k)) dr->lane_b[8*b + k] += n;
+	}
+}
+
+#ifndef CW_TILE
+#define CW_TILE 256                  /* Word weights computed at a time */
+#endif
+
+/* Add the error weights of the codewords of a block at pos, relative to
+   seek1. Whole codewords go through the word function in tiles, and the
+   pieces of codewords cut by the ends of the block through the kernel. */
+static void codeword_block(const struct diffcount_ctl *dc,
+                           const uint8_t *p1, const uint8_t *p2, size_t len,
+                           unsigned long long pos, struct diffcount_res *dr)
+{
+	const size_t cw_B = dc->cw_bits/8, cw_w = cw_B/8;
+	unsigned long long *hist = dr->cw_hist;
+	uint64_t w[CW_TILE], weight = 0;
+	/* With 64-bit codewords, consecutive words often have the same
+	   weight, so spread them over four histograms to keep the increments
+	   from waiting on each other */
+	unsigned long long h64[4][65];
+	struct diffcount_res sr;
+	size_t n, nw, t, i, j = 0;
+
+	if (cw_w == 1) memset(h64, 0, sizeof(h64));
+
+	while (len > 0) {
+		if (pos % cw_B != 0 || len < cw_B) {
+			n = cw_B - pos % cw_B;
+			if (n > len) n = len;
+			sr.diff_B = sr.diff_b = sr.flip_10 = 0;
+			compare_kernel(dc, p1, p2, NULL, n, &sr);
+			dr->cw_weight += sr.diff_b;
+			if ((pos + n) % cw_B == 0) {
+				hist[dr->cw_weight]++;
+				dr->cw_weight = 0;
+			}
+		} else {
+			/* All whole codewords left in the block, with the
+			   first j words of a codeword summed in weight */
+			n = len - len % cw_B;
+			for (t = 0; t < n/8; t += nw) {
+				nw = n/8 - t < CW_TILE ? n/8 - t : CW_TILE;
+				dc->kernel->words_fn(p1 + 8*t,
+				                     p2 ? p2 + 8*t : NULL,
+				                     dc->const_val, nw, w);
+				if (cw_w == 1) {
+					for (i = 0; i + 4 <= nw; i += 4) {
+						h64[0][w[i]]++;
+						h64[1][w[i + 1]]++;
+						h64[2][w[i + 2]]++;
+						h64[3][w[i + 3]]++;
+					}
+					for (; i < nw; i++)
+						h64[0][w[i]]++;
+					continue;
+				}
+				for (i = 0; i < nw; i++) {
+					weight += w[i];
+					if (++j == cw_w) {
+						hist[weight]++;
+						weight = 0;
+						j = 0;
+					}
+				}
+			}
+		}
+		p1 += n;
+		if (p2 != NULL) p2 += n;
+		pos += n;
+		len -= n;
+	}
+	if (cw_w == 1)
+		for (i = 0; i <= 64; i++)
+			hist[i] += h64[0][i] + h64[1][i] + h64[2][i] +
+			           h64[3][i];
+}
+
+/* Add the runs of differing bytes of a block at pos, relative to seek1, to
+   the range list */
+static void range_block(const struct diffcount_ctl *dc,
+                        const uint8_t *p1, const uint8_t *p2, size_t len,
+                        unsigned long long pos, struct diffcount_res *dr)
+{
+	uint64_t m[RANGE_TILE], mask, run_mask;
+	struct diffcount_res sr;
+	size_t t, n, i, off;
+	unsigned s, run;
+
+	for (t = 0; t < len; t += n) {
+		n = len - t < 64*RANGE_TILE ? len - t : 64*RANGE_TILE;
+		dc->kernel->masks_fn(p1 + t, p2 ? p2 + t : NULL,
+		                     dc->const_val, n, m);
+		for (i = 0; i < (n + 63)/64; i++) {
+			for (mask = m[i]; mask != 0; mask &= ~run_mask) {
+				s = __builtin_ctzll(mask);
+				run = ~(mask >> s) == 0 ? 64 - s :
+				      (unsigned)__builtin_ctzll(~(mask >> s));
+				run_mask = (run == 64 ? ~0ULL :
+				            (1ULL << run) - 1) << s;
+				off = t + 64*i + s;
+				sr.diff_B = sr.diff_b = sr.flip_10 = 0;
+				compare_kernel(dc, p1 + off,
+				               p2 ? p2 + off : NULL, NULL, run,
+				               &sr);
+				range_add(dr->rl, pos + off, run, sr.diff_b);
+			}
+		}
+	}
+}
+
+/* Add len bytes at pos, relative to seek1, that each differ in diff_b bits,
+   to the codeword error weights */
+static void codeword_uniform(const struct diffcount_ctl *dc,
+                             struct diffcount_res *dr, unsigned long long pos,
+                             unsigned long long len, unsigned diff_b)
+{
+	const unsigned long long cw_B = dc->cw_bits/8;
+	unsigned long long n;
+
+	/* Finish a codeword in progress */
+	if (pos % cw_B != 0) {
+		n = cw_B - pos % cw_B;
+		if (n > len) n = len;
+		dr->cw_weight += n*diff_b;
+		if ((pos + n) % cw_B == 0) {
+			dr->cw_hist[dr->cw_weight]++;
+			dr->cw_weight = 0;
+		}
+		pos += n;
+		len -= n;
+	}
+	dr->cw_hist[cw_B*diff_b] += len/cw_B;
+	dr->cw_weight += len % cw_B*diff_b;
+}
+
+/* Compare len bytes at pos, relative to seek1, under the mask pm if not
+   NULL, splitting them at window boundaries when profiling */
+static void compare_span(const struct diffcount_ctl *dc,
+                         const uint8_t *p1, const uint8_t *p2,
+                         const uint8_t *pm, size_t len,
+                         unsigned long long pos, struct diffcount_res *dr)
+{
+	struct profile *prof = dr->prof;
+	struct diffcount_res wr;
+	struct profile_win *w;
+	size_t n;
+
+	if (prof == NULL) {
+		compare_kernel(dc, p1, p2, pm, len, dr);
+		return;
+	}
+	while (len > 0) {
+		n = len;
+		if (prof->size - pos % prof->size < n)
+			n = prof->size - pos % prof->size;
+		wr.diff_B = wr.diff_b = wr.flip_10 = wr.mask_b = 0;
+		compare_kernel(dc, p1, p2, pm, n, &wr);
+		w = profile_at(prof, pos/prof->size);
+		w->comp_B += n;
+		w->diff_B += wr.diff_B;
+		w->diff_b += wr.diff_b;
+		dr->diff_B += wr.diff_B;
+		dr->diff_b += wr.diff_b;
+		dr->flip_10 += wr.flip_10;
+		dr->mask_b += wr.mask_b;
+		p1 += n;
+		if (p2 != NULL) p2 += n;
+		if (pm != NULL) pm += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Compare a block at pos, relative to seek1, against p2 or, when that is
+   NULL, the constant-mode reference */
+static void compare_block(const struct diffcount_ctl *dc,
+                          const uint8_t *p1, const uint8_t *p2, size_t len,
+                          unsigned long long pos, struct diffcount_res *dr)
+{
+	unsigned long long lanes[64];
+	const uint8_t *pm;
+	union ref_tile t;
+	unsigned b, k;
+	size_t n;
+
+	if (p2 == NULL && dc->ref != REF_BYTE) {
+		for (; len > 0; p1 += n, pos += n, len -= n) {
+			n = len < PATTERN_TILE ? len : PATTERN_TILE;
+			compare_block(dc, p1, dc->ref == REF_LFSR ?
+			              lfsr_get(dr->lfsr, pos, n) :
+			              ref_get(dc, dc->seek_1 + pos, n, &t),
+			              n, pos, dr);
+		}
+		return;
+	}
+
+	if (dr->cw_hist != NULL)
+		codeword_block(dc, p1, p2, len, pos, dr);
+	if (dr->rl != NULL)
+		range_block(dc, p1, p2, len, pos, dr);
+	if (dc->lane_width != 0) {
+		memset(lanes, 0, sizeof(lanes));
+		dc->kernel->lanes_fn(p1, p2, dc->const_val, len, lanes);
+		/* The block starts at byte pos % 8 of a word */
+		for (b = 0; b < 8; b++)
+			for (k = 0; k < 8; k++)
+				dr->lane_b[8*((b + pos) % 8) + k] +=
+					lanes[8*b + k];
+	}
+	if (dr->mask == NULL) {
+		compare_span(dc, p1, p2, NULL, len, pos, dr);
+		return;
+	}
+	/* In pieces as long as the mask has ready */
+	while (len > 0) {
+		n = mask_get(dr->mask, dc->seek_1 + pos, len, &pm);
+		compare_span(dc, p1, p2, pm, n, pos, dr);
+		p1 += n;
+		if (p2 != NULL) p2 += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Nonzero once dr is over the -t or -T limit */
+static int over_limit(const struct diffcount_ctl *dc,
+                      const struct diffcount_res *dr)
+{
+	return dr->diff_B > dc->limit_B || dr->diff_b > dc->limit_b;
+}
+
+/* Nonzero if the compare into dr should stop here. A range that is over
+   the limit on its own puts the whole compare over it. */
+static int stop_here(const struct diffcount_ctl *dc, struct diffcount_res *dr)
+{
+	if (over_limit(dc, dr)) dr->stopped = 1;
+	return dr->stopped ||
+	       (dr->stop != NULL && __atomic_load_n(dr->stop, __ATOMIC_RELAXED));
+}
+
+/* Bytes to compare between stop_here() checks: with -t, -T or -x, the
+   buffer size, so that every engine stops as soon, and else all of fill */
+static size_t stop_step(const struct diffcount_ctl *dc, size_t fill)
+{
+	if (dc->limit_B == NO_LIMIT && dc->limit_b == NO_LIMIT) return fill;
+	return dc->bufsize < fill ? dc->bufsize : fill;
+}
+
+/* Byte of filename at off into b. Returns 0 past EOF, or if filename
+   cannot be read at an offset, as with a pipe. */
+static int byte_at(const char *filename, unsigned long long off, uint8_t *b)
+{
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) return 0;
+	ret = pread(fd, b, 1, off) == 1;
+	close(fd);
+	return ret;
+}
+
+/* As diffcount_dense(), with either input starting at a bit offset. Block
+   i of the inputs yields the realigned bytes that start in it, save the
+   last, which needs the first byte of block i + 1. It is compared on its
+   own then. The engine reads a byte past len of both inputs, so when an
+   aligned input ends first, the byte after the last one held is read from
+   the realigned inputs alone. */
+static void diffcount_dense_bits(const struct diffcount_ctl *dc,
+                                 unsigned long long off_1,
+                                 unsigned long long off_2,
+                                 unsigned long long len,
+                                 struct diffcount_res *dr)
+{
+	const uint8_t *p1, *p2 = NULL, *q1, *q2;
+	uint8_t *s1, *s2, b1, b2, last_1 = 0, last_2 = 0;
+	unsigned long long start = off_1 - dc->seek_1, pos = start, done = 0;
+	unsigned long long gap;
+	int cmp_file = dc->cmp_mode == CMP_FILE, held = 0, stop = 0;
+	size_t fill, t, n;
+	void *st;
+	double t0;
+
+	s1 = aligned_malloc_or_die(dc->bufsize);
+	s2 = aligned_malloc_or_die(dc->bufsize);
+	st = dc->engine->open(dc, off_1, off_2, len ? len + 1 : 0);
+	while (1) {
+		fill = dc->engine->next(st, &p1, &p2);
+		if (fill == 0) break;
+
+		t0 = now();
+		if (held) {
+			b1 = dc->bit_1 ? last_1 << dc->bit_1 |
+			                 p1[0] >> (8 - dc->bit_1) : last_1;
+			b2 = dc->bit_2 && cmp_file ?
+			     last_2 << dc->bit_2 | p2[0] >> (8 - dc->bit_2) :
+			     last_2;
+			compare_block(dc, &b1, cmp_file ? &b2 : NULL, 1, pos,
+			              dr);
+			dr->comp_B++;
+			pos++;
+			if ((pos - start) % dc->bufsize == 0)
+				stop = stop_here(dc, dr);
+		}
+		/* Pieces end every bufsize bytes of the stream, where the limits
+		   are checked, so that every engine stops at the same byte */
+		for (t = 0; t + 1 < fill && !stop; t += n) {
+			gap = dc->bufsize - (pos - start) % dc->bufsize;
+			n = fill - 1 - t < gap ? fill - 1 - t : gap;
+			q1 = p1 + t;
+			q2 = cmp_file ? p2 + t : NULL;
+			if (dc->bit_1) {
+				dc->kernel->shift_fn(q1, dc->bit_1, n, s1);
+				q1 = s1;
+			}
+			if (dc->bit_2 && cmp_file) {
+				dc->kernel->shift_fn(q2, dc->bit_2, n, s2);
+				q2 = s2;
+			}
+			compare_block(dc, q1, q2, n, pos, dr);
+			dr->comp_B += n;
+			pos += n;
+			if ((pos - start) % dc->bufsize == 0)
+				stop = stop_here(dc, dr);
+		}
+		last_1 = p1[fill - 1];
+		if (cmp_file) last_2 = p2[fill - 1];
+		held = 1;
+		done += fill;
+		dr->t_kernel += now() - t0;
+		if (stop) break;
+	}
+	dc->engine->close(st);
+
+	/* The held byte is within len, and only an aligned input ended */
+	if (held && !stop && (len == 0 || done <= len) &&
+	    (dc->bit_1 == 0 || byte_at(dc->fname_1, off_1 + done, &b1)) &&
+	    (dc->bit_2 == 0 || !cmp_file ||
+	     byte_at(dc->fname_2, off_2 + done, &b2))) {
+		b1 = dc->bit_1 ? last_1 << dc->bit_1 | b1 >> (8 - dc->bit_1) :
+		     last_1;
+		b2 = dc->bit_2 && cmp_file ?
+		     last_2 << dc->bit_2 | b2 >> (8 - dc->bit_2) : last_2;
+		compare_block(dc, &b1, cmp_file ? &b2 : NULL, 1, pos, dr);
+		dr->comp_B++;
+	}
+	free(s1);
+	free(s2);
+}
+
+/* Compare len bytes (zero for up to the first EOF) starting at off_1 and
+   off_2 by reading them through the engine, accumulating into dr */
+static void diffcount_dense(const struct diffcount_ctl *dc,
+                            unsigned long long off_1,
+                            unsigned long long off_2,
+                            unsigned long long len,
+                            struct diffcount_res *dr)
+{
+	const uint8_t *p1, *p2 = NULL;
+	unsigned long long pos = off_1 - dc->seek_1;
+	size_t fill, i, n;
+	int stop = 0;
+	void *st;
+	double t;
+
+	/* The mask has to last as long as the inputs */
+	if (dc->mask_fname != NULL) {
+		len = compare_len(dc, off_1, off_2, len);
+		if (len == 0) return;
+	}
+	dr->mask = mask_open(dc, off_1, len);
+	dr->lfsr = lfsr_open(dc);
+
+	if (dc->bit_1 || dc->bit_2) {
+		diffcount_dense_bits(dc, off_1, off_2, len, dr);
+		mask_close(dr->mask);
+		dr->mask = NULL;
+		free(dr->lfsr);
+		dr->lfsr = NULL;
+		return;
+	}
+
+	st = dc->engine->open(dc, off_1, off_2, len);
+	while(1) {
+		fill = dc->engine->next(st, &p1, &p2);
+
+		/* If fill is zero, we have no new data to compare,
+		   either because we already read up to len, or
+		   because we encountered EOF in either or both of
+		   the inputs. Either way, we're done.*/
+		if (fill == 0) break;
+
+		for (i = 0; i < fill && !stop; i += n) {
+			n = stop_step(dc, fill - i);
+			t = now();
+			compare_block(dc, p1 + i, p2 != NULL ? p2 + i : NULL, n,
+			              pos, dr);
+			dr->t_kernel += now() - t;
+			dr->comp_B += n;
+			pos += n;
+			stop = stop_here(dc, dr);
+		}
+		if (stop) break;
+	}
+	dc->engine->close(st);
+	mask_close(dr->mask);
+	dr->mask = NULL;
+	free(dr->lfsr);
+	dr->lfsr = NULL;
+}
+
+/*
+ * Sparse files and shared extents
+ *
+ * Holes read as zeros, so ranges where both inputs are holes are equal
+ * without reading anything, and ranges where one input is a hole only need
+ * the other compared against zero. With -r, ranges that map to the same
+ * physical extent in both files, as with reflink copies and snapshots,
+ * are equal without reading them too.
+ *
+ * Holes are found with SEEK_DATA and SEEK_HOLE, or with FS_IOC_FIEMAP when
+ * physical locations are needed. Holes and shared ranges shorter than
+ * SPARSE_MIN are read like data, to keep the number of separate reads down
+ * on fragmented files.
+ */
+
+#ifndef SPARSE_MIN
+#define SPARSE_MIN (1ULL << 20)
+#endif
+
+#define FIEMAP_BATCH 64
+
+/* Extents whose physical location can't be compared */
+#define FIEMAP_UNMAPPED (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+                         FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE | \
+                         FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED)
+
+#define NO_PHYS (~0ULL)
+
+struct extent_cursor {
+	const char *fname;
+	int fd;
+	unsigned long long size;     /* File size */
+	struct fiemap *fm;           /* FIEMAP results, or NULL to use
+	                                SEEK_DATA and SEEK_HOLE */
+	unsigned long long fm_end;   /* Extents are known up to here */
+	unsigned idx;                /* First extent that may hold off */
+};
+
+static void extent_cursor_open(struct extent_cursor *c, const char *fname,
+                               int fiemap)
+{
+	c->fname = fname;
+	c->fd = open_or_die(fname, O_RDONLY);
+	c->size = get_filesize(fname);
+	c->fm = NULL;
+	c->fm_end = 0;
+	c->idx = 0;
+	if (fiemap)
+		c->fm = malloc_or_die(sizeof(struct fiemap) +
+		                      FIEMAP_BATCH*sizeof(struct fiemap_extent));
+}
+
+static void extent_cursor_close(struct extent_cursor *c)
+{
+	close(c->fd);
+	free(c->fm);
+}
+
+/* Fetch the extents from off onwards. Falls back to SEEK_DATA if the file
+   system doesn't support FIEMAP. */
+static void extent_cursor_fetch(struct extent_cursor *c,
+                                unsigned long long off)
+{
+	struct fiemap_extent *last;
+
+	c->fm->fm_start = off;
+	c->fm->fm_length = c->size - off;
+	c->fm->fm_flags = FIEMAP_FLAG_SYNC;
+	c->fm->fm_extent_count = FIEMAP_BATCH;
+	c->fm->fm_reserved = 0;
+	if (ioctl(c->fd, FS_IOC_FIEMAP, c->fm) == -1) {
+		free(c->fm);
+		c->fm = NULL;
+		return;
+	}
+	c->idx = 0;
+	c->fm_end = c->size;
+	if (c->fm->fm_mapped_extents == 0) return;
+	last = &c->fm->fm_extents[c->fm->fm_mapped_extents - 1];
+	if (!(last->fe_flags & FIEMAP_EXTENT_LAST) &&
+	    last->fe_logical + last->fe_length < c->size)
+		c->fm_end = last->fe_logical + last->fe_length;
+}
+
+/* Find the extent of the file at off. Sets *end to where it ends, and
+   returns nonzero if it holds data. For data at a known physical location,
+   *phys is set to the physical address of off, otherwise to NO_PHYS. */
+static int extent_at(struct extent_cursor *c, unsigned long long off,
+                     unsigned long long *end, unsigned long long *phys)
+{
+	struct fiemap_extent *fe;
+	off_t data, hole;
+
+	*phys = NO_PHYS;
+	if (c->fm != NULL && (off >= c->fm_end || off < c->fm->fm_start))
+		extent_cursor_fetch(c, off);
+
+	if (c->fm == NULL) {
+		data = lseek(c->fd, off, SEEK_DATA);
+		if (data == -1) {
+			*end = c->size;
+			/* ENXIO means nothing but a hole up to EOF. Anything
+			   else means holes can't be found, so treat it all
+			   as data. */
+			return errno != ENXIO;
+		}
+		if ((unsigned long long)data > off) {
+			*end = data;
+			return 0;
+		}
+		hole = lseek(c->fd, off, SEEK_HOLE);
+		*end = hole == -1 ? c->size : (unsigned long long)hole;
+		return 1;
+	}
+
+	for (; c->idx < c->fm->fm_mapped_extents; c->idx++) {
+		fe = &c->fm->fm_extents[c->idx];
+		if (fe->fe_logical + fe->fe_length > off) break;
+	}
+	if (c->idx == c->fm->fm_mapped_extents) {
+		*end = c->fm_end;
+		return 0;
+	}
+	fe = &c->fm->fm_extents[c->idx];
+	if (fe->fe_logical > off) {
+		*end = fe->fe_logical;
+		return 0;
+	}
+	*end = fe->fe_logical + fe->fe_length;
+	/* Unwritten extents read as zeros */
+	if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) return 0;
+	if (!(fe->fe_flags & FIEMAP_UNMAPPED))
+		*phys = fe->fe_physical + (off - fe->fe_logical);
+	return 1;
+}
+
+/* Account for len bytes at pos, relative to seek1, where the first input
+   is a hole and the second input is a hole or the constant */
+static void diffcount_zeros(const struct diffcount_ctl *dc,
+                            unsigned long long pos, unsigned long long len,
+                            struct diffcount_res *dr)
+{
+	unsigned diff_b = 0;
+
+	if (dc->cmp_mode == CMP_CONST)
+		diff_b = __builtin_popcount(dc->const_val);
+	dr->comp_B += len;
+	dr->meta_B += len;
+	dr->diff_B += diff_b ? len : 0;
+	dr->diff_b += len*diff_b;
+	if (dc->lane_width != 0 && diff_b != 0)
+		lanes_uniform(dr, pos, len, dc->const_val);
+	if (dr->cw_hist != NULL)
+		codeword_uniform(dc, dr, pos, len, diff_b);
+	if (dr->rl != NULL && diff_b != 0)
+		range_add(dr->rl, pos, len, len*diff_b);
+	if (dr->prof != NULL)
+		profile_uniform(dr->prof, pos, len, diff_b != 0, diff_b);
+}
+
+/* Compare the len bytes of fname at off against zeros */
+static void diffcount_vs_zero(const struct diffcount_ctl *dc,
+                              const char *fname, unsigned long long off,
+                              unsigned long long len,
+                              struct diffcount_res *dr)
+{
+	struct diffcount_ctl zc = *dc;
+	unsigned long long flip_10 = dr->flip_10;
+
+	zc.fname_1 = (char *)fname;
+	zc.fname_2 = NULL;
+	/* Keep window positions relative to the start of the compare */
+	if (fname == dc->fname_2) zc.seek_1 = dc->seek_2;
+	zc.cmp_mode = CMP_CONST;
+	zc.ref = REF_BYTE;
+	zc.const_val = 0;
+	diffcount_dense(&zc, off, 0, len, dr);
+	/* Bits set in file 2 over a hole in file 1 all went from 0 to 1 */
+	if (fname == dc->fname_2) dr->flip_10 = flip_10;
+}
+
+/* Nonzero if both files are on the same device, so that their physical
+   extent addresses can be compared */
+static int same_device(const char *fname_1, const char *fname_2)
+{
+	struct stat sb_1, sb_2;
+
+	return stat(fname_1, &sb_1) == 0 && stat(fname_2, &sb_2) == 0 &&
+	       sb_1.st_dev == sb_2.st_dev;
+}
+
+static void diffcount_extents(const struct diffcount_ctl *dc,
+                              unsigned long long off_1,
+                              unsigned long long off_2,
+                              unsigned long long len,
+                              struct diffcount_res *dr)
+{
+	struct extent_cursor c_1, c_2;
+	unsigned long long pos, n, end, phys_1, phys_2 = NO_PHYS;
+	unsigned long long dense_pos = 0, dense_len = 0;
+	int data_1, data_2, shared, fiemap;
+
+	len = compare_len(dc, off_1, off_2, len);
+	fiemap = dc->shared && dc->cmp_mode == CMP_FILE &&
+	         same_device(dc->fname_1, dc->fname_2);
+	extent_cursor_open(&c_1, dc->fname_1, fiemap);
+	if (dc->cmp_mode == CMP_FILE)
+		extent_cursor_open(&c_2, dc->fname_2, fiemap);
+
+	for (pos = 0; pos < len && !stop_here(dc, dr); pos += n) {
+		data_1 = extent_at(&c_1, off_1 + pos, &end, &phys_1);
+		n = end - (off_1 + pos);
+		if (dc->cmp_mode == CMP_FILE) {
+			data_2 = extent_at(&c_2, off_2 + pos, &end, &phys_2);
+			if (end - (off_2 + pos) < n) n = end - (off_2 + pos);
+		} else {
+			/* The constant is a hole exactly where file 1 is */
+			data_2 = data_1;
+		}
+		if (len - pos < n) n = len - pos;
+		shared = data_1 && data_2 && phys_1 != NO_PHYS &&
+		         phys_1 == phys_2;
+
+		/* Data on both sides, or a hole or shared range too small
+		   to bother with, extends the run of bytes to read */
+		if ((data_1 && data_2 && !shared) || n < SPARSE_MIN) {
+			if (dense_len == 0) dense_pos = pos;
+			dense_len += n;
+			continue;
+		}
+		if (dense_len != 0) {
+			diffcount_dense(dc, off_1 + dense_pos, off_2 + dense_pos,
+			                dense_len, dr);
+			dense_len = 0;
+		}
+
+		if (shared) {
+			dr->comp_B += n;
+			dr->meta_B += n;
+			if (dr->prof != NULL)
+				profile_uniform(dr->prof,
+				                off_1 + pos - dc->seek_1, n,
+				                0, 0);
+			if (dr->cw_hist != NULL)
+				codeword_uniform(dc, dr,
+				                 off_1 + pos - dc->seek_1, n, 0);
+		} else if (!data_1 && !data_2) {
+			diffcount_zeros(dc, off_1 + pos - dc->seek_1, n, dr);
+		} else if (data_1) {
+			diffcount_vs_zero(dc, dc->fname_1, off_1 + pos, n, dr);
+		} else {
+			diffcount_vs_zero(dc, dc->fname_2, off_2 + pos, n, dr);
+		}
+	}
+	if (dense_len != 0)
+		diffcount_dense(dc, off_1 + dense_pos, off_2 + dense_pos,
+		                dense_len, dr);
+
+	extent_cursor_close(&c_1);
+	if (dc->cmp_mode == CMP_FILE) extent_cursor_close(&c_2);
+}
+
+/* Compare len bytes (zero for up to the first EOF) starting at off_1 and
+   off_2, accumulating into dr */
+static void diffcount_range(const struct diffcount_ctl *dc,
+                            unsigned long long off_1,
+                            unsigned long long off_2,
+                            unsigned long long len,
+                            struct diffcount_res *dr)
+{
+	if (dc->sparse || dc->shared)
+		diffcount_extents(dc, off_1, off_2, len, dr);
+	else
+		diffcount_dense(dc, off_1, off_2, len, dr);
+}
+
+static void diffcount_res_add(const struct diffcount_ctl *dc,
+                              struct diffcount_res *dst,
+                              const struct diffcount_res *src)
+{
+	unsigned i;
+
+	dst->comp_B += src->comp_B;
+	dst->diff_B += src->diff_B;
+	dst->diff_b += src->diff_b;
+	dst->flip_10 += src->flip_10;
+	dst->meta_B += src->meta_B;
+	dst->mask_b += src->mask_b;
+	dst->t_kernel += src->t_kernel;
+	for (i = 0; i < 64; i++)
+		dst->lane_b[i] += src->lane_b[i];
+	if (src->cw_hist != NULL) {
+		for (i = 0; i <= dc->cw_bits; i++)
+			dst->cw_hist[i] += src->cw_hist[i];
+		dst->cw_weight += src->cw_weight;
+	}
+}
+
+/* Codeword error weight histogram for dc, or NULL without -E */
+static unsigned long long *codeword_hist(const struct diffcount_ctl *dc)
+{
+	unsigned long long *hist;
+
+	if (dc->cw_bits == 0) return NULL;
+	hist = calloc(dc->cw_bits + 1, sizeof(unsigned long long));
+	if (hist == NULL) {
+		perror("calloc");
+		exit(EXIT_TROUBLE);
+	}
+	return hist;
+}
+
+/*
+ * Chunked comparison
+ *
+ * The compare range is split into chunks of about CHUNK_SIZE, and of whole
+ * codewords with -E, that worker threads take in turn, each with its own
+ * engine instance and result. The results are reduced in chunk order as
+ * chunks complete, so that a profile is written out while the compare runs.
+ */
+
+struct chunk_job {
+	const struct diffcount_ctl *dc;
+	unsigned long long len;      /* Total bytes to compare */
+	unsigned long long chunk;    /* Chunk size */
+	unsigned long long nchunks;
+	unsigned long long next;     /* Next chunk to hand out */
+	struct diffcount_res *res;   /* Result of each chunk */
+	char *done;                  /* Chunks whose result is ready */
+	int stop;                    /* The reduced result is over the limit */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *chunk_worker(void *arg)
+{
+	struct chunk_job *job = arg;
+	const struct diffcount_ctl *dc = job->dc;
+	unsigned long long i, off, len;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nchunks ||
+		    __atomic_load_n(&job->stop, __ATOMIC_RELAXED))
+			break;
+
+		off = i*job->chunk;
+		len = job->len - off < job->chunk ? job->len - off : job->chunk;
+		if (dc->window != 0)
+			job->res[i].prof = profile_new(dc, off/dc->window,
+			                               NULL);
+		job->res[i].cw_hist = codeword_hist(dc);
+		job->res[i].stop = &job->stop;
+		diffcount_range(dc, dc->seek_1 + off, dc->seek_2 + off, len,
+		                &job->res[i]);
+
+		pthread_mutex_lock(&job->lock);
+		job->done[i] = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+static void diffcount_chunked(const struct diffcount_ctl *dc,
+                              struct diffcount_res *dr)
+{
+	struct chunk_job job;
+	pthread_t *threads;
+	unsigned long long i;
+	unsigned t;
+	int err;
+
+	if (!pread_usable(dc)) {
+		fprintf(stderr, "-j needs seekable inputs\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	job.dc = dc;
+	job.len = compare_len(dc, dc->seek_1, dc->seek_2, dc->max_len);
+	job.chunk = CHUNK_SIZE;
+	/* Codewords cut by a chunk boundary would be counted as two */
+	if (dc->cw_bits != 0) {
+		job.chunk -= job.chunk % (dc->cw_bits/8);
+		if (job.chunk == 0) job.chunk = dc->cw_bits/8;
+	}
+	job.nchunks = (job.len + job.chunk - 1)/job.chunk;
+	job.next = 0;
+	job.stop = 0;
+	job.res = calloc(job.nchunks ? job.nchunks : 1,
+	                 sizeof(struct diffcount_res));
+	job.done = calloc(job.nchunks ? job.nchunks : 1, 1);
+	if (job.res == NULL || job.done == NULL) {
+		perror("calloc");
+		exit(EXIT_TROUBLE);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	threads = malloc_or_die(dc->jobs*sizeof(pthread_t));
+	for (t = 0; t < dc->jobs; t++) {
+		err = pthread_create(&threads[t], NULL, chunk_worker, &job);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+
+	/* Chunks are reduced up to the one that puts the result over the
+	   limit. Later chunks are cut short and dropped. */
+	for (i = 0; i < job.nchunks && !job.stop; i++) {
+		pthread_mutex_lock(&job.lock);
+		while (!job.done[i])
+			pthread_cond_wait(&job.cond, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+		diffcount_res_add(dc, dr, &job.res[i]);
+		if (job.res[i].prof != NULL)
+			profile_merge(dr->prof, job.res[i].prof);
+		free(job.res[i].cw_hist);
+		if (job.res[i].stopped || over_limit(dc, dr)) {
+			dr->stopped = 1;
+			__atomic_store_n(&job.stop, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (t = 0; t < dc->jobs; t++)
+		pthread_join(threads[t], NULL);
+
+	for (; i < job.nchunks; i++) {
+		if (job.res[i].prof != NULL) {
+			free(job.res[i].prof->win);
+			free(job.res[i].prof);
+		}
+		free(job.res[i].cw_hist);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+	free(threads);
+	free(job.res);
+	free(job.done);
+}
+
+/*
+ * Sampling
+ *
+ * With -s, only blocks of the read buffer size are compared, one at a
+ * random offset in each of a number of equal strata of the compare range.
+ * jobs x depth threads read the samples, each through its own engine
+ * instance. The fractions of differing bytes and bits are estimated from
+ * the samples, with a 95% interval from the variance between blocks.
+ *
+ * With a target precision instead of a byte budget, a pilot sample gives
+ * the variance, and from it the number of blocks for the intervals to
+ * come within the target.
+ */
+
+#ifndef SAMPLE_PILOT
+#define SAMPLE_PILOT 256             /* Blocks in the pilot sample */
+#endif
+
+#define SAMPLE_Z 1.96                /* 95% two-sided normal quantile */
+
+struct sample_job {
+	struct diffcount_ctl sc;     /* dc, reading one block at a time */
+	unsigned long long n;        /* Blocks to sample */
+	unsigned long long next;     /* Next block to hand out */
+	unsigned long long *pos;     /* Offset of each block from seek1 */
+	struct diffcount_res *res;   /* Result of each block */
+	unsigned threads;            /* Reading threads */
+	pthread_mutex_t lock;
+};
+
+/* xorshift64* */
+static uint64_t sample_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state*0x2545f4914f6cdd1dULL;
+}
+
+/* Square root, without needing libm */
+static double sample_sqrt(double x)
+{
+	return _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(x)));
+}
+
+/* Place n blocks of the buffer size in len bytes, one at a random,
+   aligned offset in each of n equal strata. Needs n blocks to fit. */
+static void sample_place(const struct diffcount_ctl *dc,
+                         unsigned long long len, unsigned long long n,
+                         unsigned long long *pos, uint64_t *rng)
+{
+	unsigned long long k, start, end, off;
+
+	for (k = 0; k < n; k++) {
+		start = (unsigned __int128)len*k/n;
+		end = (unsigned __int128)len*(k + 1)/n;
+		off = start;
+		if (end - start > dc->bufsize) {
+			off += sample_rand(rng) % (end - start - dc->bufsize + 1);
+			off -= off % dc->align;
+			if (off < start) off = start;
+		}
+		pos[k] = off;
+	}
+}
+
+static void *sample_worker(void *arg)
+{
+	struct sample_job *job = arg;
+	const struct diffcount_ctl *sc = &job->sc;
+	unsigned long long i;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->n) break;
+
+		diffcount_range(sc, sc->seek_1 + job->pos[i],
+		                sc->seek_2 + job->pos[i], sc->bufsize,
+		                &job->res[i]);
+	}
+	return NULL;
+}
+
+/* Compare n blocks at pos into res */
+static void sample_run(struct sample_job *job, unsigned long long n,
+                       unsigned long long *pos, struct diffcount_res *res)
+{
+	unsigned threads = job->threads;
+	pthread_t *thread;
+	unsigned t;
+	int err;
+
+	job->n = n;
+	job->next = 0;
+	job->pos = pos;
+	job->res = res;
+	if (threads > n) threads = n;
+	thread = malloc_or_die(threads*sizeof(pthread_t));
+	for (t = 0; t < threads; t++) {
+		err = pthread_create(&thread[t], NULL, sample_worker, job);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	for (t = 0; t < threads; t++)
+		pthread_join(thread[t], NULL);
+	free(thread);
+}
+
+/* Estimate the differing byte and bit fractions from the n blocks in res,
+   out of m blocks in all, into dr */
+static void sample_estimate(const struct diffcount_res *res,
+                            unsigned long long n, unsigned long long m,
+                            struct diffcount_res *dr)
+{
+	double y_B, y_b, sum_B = 0, sum_b = 0, sq_B = 0, sq_b = 0, fpc;
+	double var_B, var_b;
+	unsigned long long i;
+
+	for (i = 0; i < n; i++) {
+		y_B = 1.0*res[i].diff_B/res[i].comp_B;
+		y_b = 1.0*res[i].diff_b/(8*res[i].comp_B);
+		sum_B += y_B;
+		sum_b += y_b;
+		sq_B += y_B*y_B;
+		sq_b += y_b*y_b;
+	}
+	dr->est_B = sum_B/n;
+	dr->est_b = sum_b/n;
+	/* Sample variance of the block fractions, with the finite population
+	   correction. Stratification only makes the true variance smaller. */
+	fpc = n < m ? 1.0 - 1.0*n/m : 0;
+	/* Equal fractions can round to a variance just below zero */
+	var_B = (sq_B - n*dr->est_B*dr->est_B)/(n - 1);
+	var_b = (sq_b - n*dr->est_b*dr->est_b)/(n - 1);
+	if (var_B < 0) var_B = 0;
+	if (var_b < 0) var_b = 0;
+	dr->err_B = SAMPLE_Z*sample_sqrt(fpc/n*var_B);
+	dr->err_b = SAMPLE_Z*sample_sqrt(fpc/n*var_b);
+}
+
+/* Number of blocks for 95% intervals of half-width err, out of m, from
+   the half-widths of a sample of n */
+static unsigned long long sample_need(const struct diffcount_res *dr,
+                                      unsigned long long n,
+                                      unsigned long long m, double err)
+{
+	double w, n_0;
+
+	/* Undo the finite population correction, then reapply it */
+	w = dr->err_B > dr->err_b ? dr->err_B : dr->err_b;
+	if (n >= m) return m;
+	n_0 = n*(w/err)*(w/err)/(1.0 - 1.0*n/m);
+	return n_0/(1 + n_0/m) + 1;
+}
+
+/* Compare n blocks placed in len bytes, out of m blocks in all, and
+   estimate the fractions from them into dr. Returns the result of each
+   block. */
+static struct diffcount_res *sample_take(struct sample_job *job,
+                                         unsigned long long len,
+                                         unsigned long long m,
+                                         unsigned long long n,
+                                         uint64_t *rng,
+                                         struct diffcount_res *dr)
+{
+	struct diffcount_res *res;
+	unsigned long long *pos;
+
+	pos = malloc_or_die(n*sizeof(unsigned long long));
+	res = calloc(n, sizeof(struct diffcount_res));
+	if (res == NULL) {
+		perror("calloc");
+		exit(EXIT_TROUBLE);
+	}
+	sample_place(&job->sc, len, n, pos, rng);
+	sample_run(job, n, pos, res);
+	sample_estimate(res, n, m, dr);
+	free(pos);
+	return res;
+}
+
+static void diffcount_sampled(const struct diffcount_ctl *dc,
+                              struct diffcount_res *dr)
+{
+	struct sample_job job;
+	struct diffcount_res *res = NULL;
+	unsigned long long len, m, n, need, i;
+	uint64_t rng;
+
+	if (!pread_usable(dc)) {
+		fprintf(stderr, "-s needs seekable inputs\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	len = compare_len(dc, dc->seek_1, dc->seek_2, dc->max_len);
+	m = len/dc->bufsize;
+	n = dc->sample_err != 0 ? SAMPLE_PILOT : dc->sample_B/dc->bufsize;
+	if (n < 2) n = 2;
+
+	job.sc = *dc;
+	job.sc.ring_depth = 1;
+	job.threads = dc->jobs*dc->ring_depth;
+	pthread_mutex_init(&job.lock, NULL);
+	rng = (uint64_t)(now()*1e9) | 1;
+
+	if (n < m) res = sample_take(&job, len, m, n, &rng, dr);
+	/* Resample at the size the pilot calls for. The pilot is not
+	   reused, so that the blocks stay one per stratum. */
+	if (res != NULL && dc->sample_err != 0) {
+		need = sample_need(dr, n, m, dc->sample_err);
+		if (need > n) {
+			free(res);
+			res = NULL;
+			n = need;
+			if (n < m) res = sample_take(&job, len, m, n, &rng, dr);
+		}
+	}
+	pthread_mutex_destroy(&job.lock);
+
+	/* Samples as large as the range are a full compare */
+	if (res == NULL) {
+		diffcount_range(dc, dc->seek_1, dc->seek_2, dc->max_len, dr);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		diffcount_res_add(dc, dr, &res[i]);
+	dr->samples = n;
+	dr->sample_of = len;
+	free(res);
+}
+
+/*
+ * Alignment search
+ *
+ * With -A, the lag between the inputs that makes them most alike is found
+ * first, and the compare then runs at that lag. Lag d pairs file 1 at
+ * seek1 with file 2 at seek2 + d, or file 1 at seek1 - d with file 2 at
+ * seek2 when d is negative. Every lag in the range is scored on the same
+ * probe of -P bytes of file 1, against the region of file 2 the lags
+ * cover.
+ *
+ * Lags are scored directly, by running the compare kernel over the probe
+ * at each one on -j threads, until that would cost more than scoring them
+ * all at once through FFTs. The bit planes of the probe and the region,
+ * as +1 and -1, are correlated pairwise as the real and imaginary parts
+ * of complex signals, and the real part of the summed correlation gives
+ * the differing bits at every lag. The best ALIGN_REFINE of those are
+ * then scored directly for their byte counts.
+ */
+
+#ifndef ALIGN_REFINE
+#define ALIGN_REFINE 64              /* Lags rescored after the FFT */
+#endif
+
+#ifndef ALIGN_FFT_COST
+#define ALIGN_FFT_COST 512           /* Kernel bytes per FFT point and
+                                        level, roughly */
+#endif
+
+#define ALIGN_BATCH 64               /* Lags handed out at a time */
+#define ALIGN_BEST 5                 /* Lags reported */
+
+struct align_score {
+	long long lag;
+	unsigned long long diff_B;
+	unsigned long long diff_b;
+};
+
+struct align_job {
+	const struct diffcount_ctl *dc;
+	const uint8_t *probe;        /* Probe from file 1 */
+	const uint8_t *region;       /* File 2 at the first lag */
+	size_t w;                    /* Probe length */
+	struct align_score *score;   /* Lags to score */
+	size_t n;
+	size_t next;                 /* Next lag to hand out */
+	pthread_mutex_t lock;
+};
+
+static void *align_worker(void *arg)
+{
+	struct align_job *job = arg;
+	struct diffcount_res r;
+	struct align_score *sc;
+	size_t i, end;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next;
+		job->next += ALIGN_BATCH;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->n) break;
+
+		end = job->n - i < ALIGN_BATCH ? job->n : i + ALIGN_BATCH;
+		for (; i < end; i++) {
+			sc = &job->score[i];
+			r.diff_B = r.diff_b = r.flip_10 = 0;
+			job->dc->kernel->fn(job->probe, job->region +
+			                    (sc->lag - job->dc->lag_min),
+			                    job->w, &r);
+			sc->diff_B = r.diff_B;
+			sc->diff_b = r.diff_b;
+		}
+	}
+	return NULL;
+}
+
+/* Score the n lags in score directly */
+static void align_direct(struct align_job *job, struct align_score *score,
+                         size_t n)
+{
+	pthread_t *threads;
+	unsigned t, nthreads = job->dc->jobs;
+	int err;
+
+	job->score = score;
+	job->n = n;
+	job->next = 0;
+	threads = malloc_or_die(nthreads*sizeof(pthread_t));
+	for (t = 0; t < nthreads; t++) {
+		err = pthread_create(&threads[t], NULL, align_worker, job);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+}
+
+/* Fewest differing bits first, then fewest bytes, then the smallest lag */
+static int align_cmp(const void *a, const void *b)
+{
+	const struct align_score *x = a, *y = b;
+	unsigned long long ax = x->lag < 0 ? -x->lag : x->lag;
+	unsigned long long ay = y->lag < 0 ? -y->lag : y->lag;
+
+	if (x->diff_b != y->diff_b) return x->diff_b < y->diff_b ? -1 : 1;
+	if (x->diff_B != y->diff_B) return x->diff_B < y->diff_B ? -1 : 1;
+	if (ax != ay) return ax < ay ? -1 : 1;
+	return x->lag < y->lag ? -1 : x->lag > y->lag;
+}
+
+/* Twiddle factors exp(-2 pi i k/n) for k < n/2. Those at powers of two
+   come from pi/2 by the half-angle formulas, and the rest are products of
+   at most log2(n) of them. */
+static void fft_twiddles(size_t n, double *tw_re, double *tw_im)
+{
+	double c = 0, s = 1;         /* Angle pi/2, at n/4 */
+	size_t t, k;
+
+	tw_re[0] = 1;
+	tw_im[0] = 0;
+	for (t = n/4; t >= 1; t >>= 1) {
+		tw_re[t] = c;
+		tw_im[t] = -s;
+		c = sample_sqrt((1 + c)/2);
+		s = s/(2*c);
+	}
+	for (t = 2; t < n/2; t <<= 1) {
+		for (k = 1; k < t; k++) {
+			tw_re[k + t] = tw_re[k]*tw_re[t] - tw_im[k]*tw_im[t];
+			tw_im[k + t] = tw_re[k]*tw_im[t] + tw_im[k]*tw_re[t];
+		}
+	}
+}
+
+/* In-place radix-2 FFT of n points, n a power of two at least 4. With
+   inverse, conjugates the twiddles, without scaling by 1/n. */
+static void fft(double *re, double *im, size_t n, const double *tw_re,
+                const double *tw_im, int inverse)
+{
+	double t_re, t_im, w_re, w_im, sign = inverse ? -1 : 1;
+	size_t i, j, k, len, half, step, bit;
+
+	for (i = 1, j = 0; i < n; i++) {
+		for (bit = n >> 1; j & bit; bit >>= 1) j ^= bit;
+		j |= bit;
+		if (i < j) {
+			t_re = re[i]; re[i] = re[j]; re[j] = t_re;
+			t_im = im[i]; im[i] = im[j]; im[j] = t_im;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		half = len/2;
+		step = n/len;
+		for (i = 0; i < n; i += len) {
+			for (k = 0; k < half; k++) {
+				w_re = tw_re[k*step];
+				w_im = sign*tw_im[k*step];
+				j = i + k + half;
+				t_re = re[j]*w_re - im[j]*w_im;
+				t_im = re[j]*w_im + im[j]*w_re;
+				re[j] = re[i + k] - t_re;
+				im[j] = im[i + k] - t_im;
+				re[i + k] += t_re;
+				im[i + k] += t_im;
+			}
+		}
+	}
+}
+
+/* Differing bits of the probe against the region at each of nlags lags,
+   into score, from the correlation of their bit planes */
+static void align_fft(const struct align_job *job, size_t nlags,
+                      struct align_score *score)
+{
+	double *x_re, *x_im, *y_re, *y_im, *acc_re, *acc_im, *tw_re, *tw_im;
+	double re, im;
+	size_t n, i, w = job->w, span = job->w + nlags - 1;
+	unsigned p;
+
+	for (n = 4; n < span; n <<= 1);
+	x_re = malloc_or_die(n*sizeof(double));
+	x_im = malloc_or_die(n*sizeof(double));
+	y_re = malloc_or_die(n*sizeof(double));
+	y_im = malloc_or_die(n*sizeof(double));
+	acc_re = calloc(n, sizeof(double));
+	acc_im = calloc(n, sizeof(double));
+	tw_re = malloc_or_die(n/2*sizeof(double));
+	tw_im = malloc_or_die(n/2*sizeof(double));
+	if (acc_re == NULL || acc_im == NULL) {
+		perror("calloc");
+		exit(EXIT_TROUBLE);
+	}
+	fft_twiddles(n, tw_re, tw_im);
+
+	/* Bit planes 2p and 2p + 1 as the real and imaginary parts */
+	for (p = 0; p < 4; p++) {
+		for (i = 0; i < n; i++) {
+			x_re[i] = i < w ?
+				1 - 2.0*((job->probe[i] >> 2*p) & 1) : 0;
+			x_im[i] = i < w ?
+				1 - 2.0*((job->probe[i] >> (2*p + 1)) & 1) : 0;
+			y_re[i] = i < span ?
+				1 - 2.0*((job->region[i] >> 2*p) & 1) : 0;
+			y_im[i] = i < span ?
+				1 - 2.0*((job->region[i] >> (2*p + 1)) & 1) : 0;
+		}
+		fft(x_re, x_im, n, tw_re, tw_im, 0);
+		fft(y_re, y_im, n, tw_re, tw_im, 0);
+		/* Correlation is the conjugate of x times y */
+		for (i = 0; i < n; i++) {
+			re = x_re[i]*y_re[i] + x_im[i]*y_im[i];
+			im = x_re[i]*y_im[i] - x_im[i]*y_re[i];
+			acc_re[i] += re;
+			acc_im[i] += im;
+		}
+	}
+	fft(acc_re, acc_im, n, tw_re, tw_im, 1);
+
+	/* Agreeing bits count +1 and differing bits -1 */
+	for (i = 0; i < nlags; i++) {
+		score[i].lag = job->dc->lag_min + (long long)i;
+		score[i].diff_B = 0;
+		score[i].diff_b = (8.0*w - acc_re[i]/n)/2 + 0.5;
+	}
+
+	free(x_re);
+	free(x_im);
+	free(y_re);
+	free(y_im);
+	free(acc_re);
+	free(acc_im);
+	free(tw_re);
+	free(tw_im);
+}
+
+/* Read up to len bytes of fname at off into a new buffer. Sets *got to
+   the number read. */
+static uint8_t *align_read(const char *fname, unsigned long long off,
+                           size_t len, size_t *got)
+{
+	uint8_t *buf;
+	int fd;
+
+	buf = malloc_or_die(len ? len : 1);
+	fd = open_or_die(fname, O_RDONLY);
+	*got = pread_full(fd, fname, buf, len, off);
+	close(fd);
+	return buf;
+}
+
+/* Find the lag with the fewest differences over the probe, report the
+   best few, and move seek1 and seek2 to it */
+static void align_search(struct diffcount_ctl *dc)
+{
+	struct align_job job;
+	struct align_score *score;
+	unsigned long long skip = dc->lag_min < 0 ? -dc->lag_min : 0;
+	size_t nlags = dc->lag_max - dc->lag_min + 1, got_1, got_2, n, i, k;
+	uint8_t *probe, *region;
+	double direct, fft_cost;
+	long long lag;
+
+	if (!pread_usable(dc)) {
+		fprintf(stderr, "-A needs seekable inputs\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	/* The probe starts where the most negative lag leaves room, and the
+	   region covers the probe at every lag */
+	probe = align_read(dc->fname_1, dc->seek_1 + skip, dc->probe, &got_1);
+	region = align_read(dc->fname_2, dc->seek_2 + skip + dc->lag_min,
+	                    dc->probe + nlags - 1, &got_2);
+	job.w = got_1;
+	if (got_2 < job.w + nlags - 1)
+		job.w = got_2 > nlags - 1 ? got_2 - (nlags - 1) : 0;
+	if (job.w == 0) {
+		fprintf(stderr, "-A: inputs too short for the lag range\n");
+		exit(EXIT_TROUBLE);
+	}
+	job.dc = dc;
+	job.probe = probe;
+	job.region = region;
+	pthread_mutex_init(&job.lock, NULL);
+
+	score = malloc_or_die(nlags*sizeof(struct align_score));
+	for (n = 4; n < job.w + nlags - 1; n <<= 1);
+	for (k = 0, i = n; i > 1; i >>= 1) k++;
+	direct = 1.0*job.w*nlags/dc->jobs;
+	fft_cost = 1.0*ALIGN_FFT_COST*n*k;
+	if (direct <= fft_cost) {
+		for (i = 0; i < nlags; i++)
+			score[i].lag = dc->lag_min + (long long)i;
+		align_direct(&job, score, nlags);
+		n = nlags;
+	} else {
+		align_fft(&job, nlags, score);
+		qsort(score, nlags, sizeof(struct align_score), align_cmp);
+		n = nlags < ALIGN_REFINE ? nlags : ALIGN_REFINE;
+		align_direct(&job, score, n);
+	}
+	qsort(score, n, sizeof(struct align_score), align_cmp);
+
+	printf("Lags %lld to %lld scored on %zu bytes%s:\n", dc->lag_min,
+	       dc->lag_max, job.w, direct <= fft_cost ? "" : " by FFT");
+	printf("                Lag    Byte count    Byte fraction"
+	       "       Bit count     Bit fraction\n");
+	for (i = 0; i < n && i < ALIGN_BEST; i++)
+		printf("%c %16lld  %12llu  %14.13f  %14llu  %14.13f\n",
+		       i == 0 ? '*' : ' ', score[i].lag, score[i].diff_B,
+		       1.0*score[i].diff_B/job.w, score[i].diff_b,
+		       1.0*score[i].diff_b/(8*job.w));
+	printf("\n");
+
+	lag = score[0].lag;
+	if (lag < 0) dc->seek_1 += -lag;
+	else dc->seek_2 += lag;
+
+	pthread_mutex_destroy(&job.lock);
+	free(score);
+	free(probe);
+	free(region);
+}
+
+/*
+ * Input cursors
+ *
+ * With more than two inputs, each is read through an engine instance of
+ * its own, as a mask file is, so every input has the read buffers and
+ * reader thread of the selected engine, and blocks are compared as far as
+ * the shortest piece any input has ready.
+ */
+
+struct input_cursor {
+	struct diffcount_ctl ic;     /* dc, reading this input as file 1 */
+	void *st;                    /* Engine state */
+	const uint8_t *p;            /* Current block, */
+	size_t fill;                 /* its length, */
+	size_t used;                 /* and how much of it is used */
+	int eof;                     /* The input has ended */
+};
+
+/* Start reading len bytes (zero for up to EOF) of fname at off */
+static void cursor_open(struct input_cursor *c,
+                        const struct diffcount_ctl *dc, char *fname,
+                        unsigned long long off, unsigned long long len)
+{
+	c->ic = *dc;
+	c->ic.fname_1 = fname;
+	c->ic.fname_2 = NULL;
+	c->ic.cmp_mode = CMP_CONST;
+	/* The inputs may be different kinds of file */
+	c->ic.engine = dc->engine->usable(&c->ic) ? dc->engine :
+	               select_engine(&c->ic, "auto");
+	c->st = c->ic.engine->open(&c->ic, off, 0, len);
+	c->fill = c->used = 0;
+	c->eof = 0;
+}
+
+/* Bytes ready at c->p + c->used, reading the next block when there are
+   none. Zero at the end. */
+static size_t cursor_avail(struct input_cursor *c)
+{
+	const uint8_t *unused;
+
+	if (c->used == c->fill && !c->eof) {
+		c->fill = c->ic.engine->next(c->st, &c->p, &unused);
+		c->used = 0;
+		c->eof = c->fill == 0;
+	}
+	return c->fill - c->used;
+}
+
+static void cursor_close(struct input_cursor *c)
+{
+	c->ic.engine->close(c->st);
+}
+
+/*
+ * N-way comparison
+ *
+ * With -N, the inputs are read through cursors and voted on until the
+ * first EOF. The majority goes to the -V file at the same offset. With
+ * -j, threads take chunks of CHUNK_SIZE in turn, each with its own
+ * cursors, and write the majority with pwrite, so chunks can finish in any
+ * order.
+ */
+
+struct vote_job {
+	const struct diffcount_ctl *dc;
+	unsigned long long len;      /* Total bytes to vote on */
+	unsigned long long nchunks;
+	unsigned long long next;     /* Next chunk to hand out */
+	int fd;                      /* Majority output, or -1 */
+	struct vote_res *vr;         /* Sum of the chunks done */
+	pthread_mutex_t lock;
+};
+
+/* Bytes to vote on: up to the end of the shortest input of known size,
+   and at most max_len. Zero for up to the first EOF. */
+static unsigned long long vote_len(const struct diffcount_ctl *dc)
+{
+	unsigned long long len = dc->max_len, size;
+	unsigned f;
+
+	for (f = 0; f < dc->nfiles; f++) {
+		if (!known_size(dc->fnames[f])) continue;
+		size = get_filesize(dc->fnames[f]);
+		if (len == 0 || size < len) len = size;
+	}
+	return len;
+}
+
+static void vote_res_add(const struct diffcount_ctl *dc,
+                         struct vote_res *dst, const struct vote_res *src)
+{
+	unsigned f, k;
+
+	dst->comp_B += src->comp_B;
+	dst->any_B += src->any_B;
+	dst->any_b += src->any_b;
+	for (k = 0; k <= dc->nfiles/2; k++) dst->hist[k] += src->hist[k];
+	for (f = 0; f < dc->nfiles; f++) dst->copy_b[f] += src->copy_b[f];
+	dst->t_kernel += src->t_kernel;
+}
+
+/* Vote on len bytes (zero for up to the first EOF) at off in every input,
+   writing the majority to fd unless that is -1 */
+static void vote_range(const struct diffcount_ctl *dc,
+                       unsigned long long off, unsigned long long len,
+                       int fd, struct vote_res *vr)
+{
+	struct input_cursor *in;
+	const uint8_t *bufs[VOTE_MAX];
+	uint8_t *out = NULL;
+	size_t n, avail;
+	unsigned f;
+	double t;
+
+	in = malloc_or_die(dc->nfiles*sizeof(struct input_cursor));
+	for (f = 0; f < dc->nfiles; f++)
+		cursor_open(&in[f], dc, dc->fnames[f], off, len);
+	if (fd != -1) out = malloc_or_die(dc->bufsize);
+
+	while (1) {
+		n = dc->bufsize;
+		for (f = 0; f < dc->nfiles; f++) {
+			avail = cursor_avail(&in[f]);
+			if (avail < n) n = avail;
+			bufs[f] = in[f].p + in[f].used;
+		}
+		if (n == 0) break;
+
+		t = now();
+		dc->kernel->vote_fn(bufs, dc->nfiles, n, out, vr);
+		vr->t_kernel += now() - t;
+		if (out != NULL)
+			write_full(fd, dc->vote_fname, out, n, off, dc->jobs == 1);
+		for (f = 0; f < dc->nfiles; f++) in[f].used += n;
+		vr->comp_B += n;
+		off += n;
+	}
+
+	for (f = 0; f < dc->nfiles; f++) cursor_close(&in[f]);
+	free(in);
+	free(out);
+}
+
+static void *vote_worker(void *arg)
+{
+	struct vote_job *job = arg;
+	unsigned long long i, off, len;
+	struct vote_res r;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nchunks) break;
+
+		off = i*CHUNK_SIZE;
+		len = job->len - off < CHUNK_SIZE ? job->len - off : CHUNK_SIZE;
+		memset(&r, 0, sizeof(r));
+		vote_range(job->dc, off, len, job->fd, &r);
+
+		pthread_mutex_lock(&job->lock);
+		vote_res_add(job->dc, job->vr, &r);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+static void vote_chunked(const struct diffcount_ctl *dc, int fd,
+                         struct vote_res *vr)
+{
+	struct vote_job job;
+	pthread_t *threads;
+	unsigned f, t;
+	int err;
+
+	for (f = 0; f < dc->nfiles; f++) {
+		if (!is_seekable(dc->fnames[f])) {
+			fprintf(stderr, "-j needs seekable inputs\n");
+			exit(EXIT_TROUBLE);
+		}
+	}
+
+	job.dc = dc;
+	job.len = vote_len(dc);
+	job.nchunks = (job.len + CHUNK_SIZE - 1)/CHUNK_SIZE;
+	job.next = 0;
+	job.fd = fd;
+	job.vr = vr;
+	pthread_mutex_init(&job.lock, NULL);
+
+	threads = malloc_or_die(dc->jobs*sizeof(pthread_t));
+	for (t = 0; t < dc->jobs; t++) {
+		err = pthread_create(&threads[t], NULL, vote_worker, &job);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	for (t = 0; t < dc->jobs; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_mutex_destroy(&job.lock);
+	free(threads);
+}
+
+static struct vote_res *diffcount_vote(const struct diffcount_ctl *dc)
+{
+	struct vote_res *vr;
+	double t_start;
+	unsigned k;
+	int fd = -1;
+
+	t_start = now();
+	vr = malloc_or_die(sizeof(struct vote_res));
+	memset(vr, 0, sizeof(struct vote_res));
+	if (dc->vote_fname != NULL) {
+		fd = open(dc->vote_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd == -1) {
+			fprintf(stderr, "open %s: %s\n", dc->vote_fname,
+			        strerror(errno));
+			exit(EXIT_TROUBLE);
+		}
+	}
+
+	if (dc->jobs > 1)
+		vote_chunked(dc, fd, vr);
+	else
+		vote_range(dc, 0, dc->max_len, fd, vr);
+
+	if (fd != -1 && close(fd) != 0) {
+		fprintf(stderr, "close %s: %s\n", dc->vote_fname,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+	vr->hist[0] = 8*vr->comp_B;
+	for (k = 1; k <= dc->nfiles/2; k++) vr->hist[0] -= vr->hist[k];
+	vr->t_total = now() - t_start;
+
+	return vr;
+}
+
+/*
+ * Batch comparison
+ *
+ * With -B, file 1 is compared against every target in a list. Targets are
+ * taken in groups of up to BATCH_GROUP, and each group makes one pass over
+ * file 1: each block of it is compared against the matching block of
+ * every target in the group in turn, while it is still in cache. Targets
+ * that end drop out of the group, and the pass ends with file 1 or the
+ * last target. With -j, threads take groups in turn, and groups are made
+ * small enough to go around.
+ */
+
+struct batch_target {
+	char *fname;
+	unsigned long long seek;     /* Offset of the target */
+	struct diffcount_res res;
 };
 
-/* Diffcount result */
-struct diffcount_res {
-	unsigned long long comp_B;   /* Total number of bytes compared */
-	unsigned long long comp_b;   /* Total number of bits compared */
-	unsigned long long diff_B;   /* Number of different bytes */
-	unsigned long long diff_b;   /* Number of different bits */
+struct batch_job {
+	const struct diffcount_ctl *dc;
+	struct batch_target *t;
+	size_t n;                    /* Targets, */
+	size_t group;                /* per group */
+	size_t next;                 /* First target of the next group */
+	double t_kernel;             /* Seconds spent comparing */
+	pthread_mutex_t lock;
 };
 
-static void *malloc_or_die(size_t size)
+/* Compare file 1 against the n targets t in one pass */
+static double batch_group(const struct diffcount_ctl *dc,
+                          struct batch_target *t, size_t n)
 {
-	void *buf;
+	struct input_cursor ref, *in;
+	size_t i, m, avail;
+	double t_kernel = 0, t0;
+	int live;
 
-	buf = malloc(size);
-	if (buf == NULL) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+	in = malloc_or_die(n*sizeof(struct input_cursor));
+	cursor_open(&ref, dc, dc->fname_1, dc->seek_1, dc->max_len);
+	for (i = 0; i < n; i++)
+		cursor_open(&in[i], dc, t[i].fname, t[i].seek, dc->max_len);
+
+	while ((m = cursor_avail(&ref)) != 0) {
+		live = 0;
+		for (i = 0; i < n; i++) {
+			avail = cursor_avail(&in[i]);
+			if (avail == 0) continue;
+			if (avail < m) m = avail;
+			live = 1;
+		}
+		if (!live) break;
+
+		t0 = now();
+		for (i = 0; i < n; i++) {
+			if (in[i].eof) continue;
+			dc->kernel->fn(ref.p + ref.used, in[i].p + in[i].used,
+			               m, &t[i].res);
+			t[i].res.comp_B += m;
+			in[i].used += m;
+		}
+		t_kernel += now() - t0;
+		ref.used += m;
 	}
-	return buf;
+
+	cursor_close(&ref);
+	for (i = 0; i < n; i++) cursor_close(&in[i]);
+	free(in);
+	return t_kernel;
 }
 
-/* Initialize struct diffcount_ctl and set defaults */
-static struct diffcount_ctl *diffcount_ctl_init(void)
+static void *batch_worker(void *arg)
 {
-	struct diffcount_ctl *dc;
+	struct batch_job *job = arg;
+	size_t first, n;
+	double t;
 
-	dc = malloc_or_die(sizeof(struct diffcount_ctl));
-	dc->fname_1 = NULL;
-	dc->fname_2 = NULL;
-	dc->seek_1 = 0;
-	dc->seek_2 = 0;
-	dc->max_len = 0;
-	dc->cmp_mode = CMP_FILE;
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		first = job->next;
+		job->next += job->group;
+		pthread_mutex_unlock(&job->lock);
+		if (first >= job->n) break;
 
-	return dc;
+		n = job->n - first < job->group ? job->n - first : job->group;
+		t = batch_group(job->dc, job->t + first, n);
+
+		pthread_mutex_lock(&job->lock);
+		job->t_kernel += t;
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
 }
 
-static FILE *fopen_and_seek(const char *filename, off_t seek)
+/* Read the target list: a path per line, optionally followed by its
+   offset, with blank lines and lines starting with # skipped. Targets
+   without an offset are read at seek2. */
+static struct batch_target *batch_read(const struct diffcount_ctl *dc,
+                                       size_t *n)
 {
-	FILE *stream;
+	struct batch_target *t = NULL;
+	size_t cap = 0, len = 0, line_no = 0;
+	char *line = NULL, *path, *seek;
+	unsigned long long off;
+	unsigned bit;
+	FILE *list;
 
-	stream = fopen(filename, "r");
-	if (stream == NULL) {
-		fprintf(stderr, "fopen %s: %s\n", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+	list = strcmp(dc->batch_fname, "-") == 0 ? stdin :
+	       fopen(dc->batch_fname, "r");
+	if (list == NULL) {
+		fprintf(stderr, "fopen %s: %s\n", dc->batch_fname,
+		        strerror(errno));
+		exit(EXIT_TROUBLE);
+	}
+
+	*n = 0;
+	while (getline(&line, &len, list) != -1) {
+		line_no++;
+		path = strtok(line, " \t\r\n");
+		if (path == NULL || path[0] == '#') continue;
+		seek = strtok(NULL, " \t\r\n");
+		off = dc->seek_2;
+		bit = 0;
+		if ((seek != NULL && !parse_seek(seek, &off, &bit)) || bit != 0 ||
+		    strtok(NULL, " \t\r\n") != NULL) {
+			fprintf(stderr, "%s:%zu: expected a path and a byte "
+			        "offset\n", dc->batch_fname, line_no);
+			exit(EXIT_TROUBLE);
+		}
+		if (*n == cap) {
+			cap = cap ? 2*cap : 64;
+			t = realloc(t, cap*sizeof(struct batch_target));
+			if (t == NULL) {
+				perror("realloc");
+				exit(EXIT_TROUBLE);
+			}
+		}
+		memset(&t[*n], 0, sizeof(struct batch_target));
+		t[*n].fname = strdup(path);
+		if (t[*n].fname == NULL) {
+			perror("strdup");
+			exit(EXIT_TROUBLE);
+		}
+		t[*n].seek = off;
+		(*n)++;
 	}
-	if (fseeko(stream, seek, 0) == -1) {
-		fprintf(stderr, "fseeko %s: %s", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+
+	free(line);
+	if (list != stdin) fclose(list);
+	if (*n == 0) {
+		fprintf(stderr, "%s: no targets\n", dc->batch_fname);
+		exit(EXIT_TROUBLE);
 	}
-	return stream;
+	return t;
 }
 
-static off_t get_filesize(const char *filename)
+static void diffcount_batch(const struct diffcount_ctl *dc,
+                            struct batch_target *bt, size_t n,
+                            double *t_total, double *t_kernel)
 {
-	struct stat sb;
+	struct batch_job job;
+	pthread_t *threads;
+	double t_start;
+	unsigned t;
+	size_t i;
+	int err;
 
-	if (stat(filename, &sb) == -1) {
-		fprintf(stderr, "fstat: %s: %s\n", filename,
-		        strerror(errno));
-		exit(EXIT_FAILURE);
+	job.dc = dc;
+	job.t = bt;
+	job.n = n;
+	/* Every thread gets a group, where there are enough targets */
+	job.group = (job.n + dc->jobs - 1)/dc->jobs;
+	if (job.group > BATCH_GROUP) job.group = BATCH_GROUP;
+	if (job.group < job.n && !is_seekable(dc->fname_1)) {
+		fprintf(stderr, "-B needs a seekable file1 for more than one "
+		        "group of targets\n");
+		exit(EXIT_TROUBLE);
+	}
+	job.next = 0;
+	job.t_kernel = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	t_start = now();
+	threads = malloc_or_die(dc->jobs*sizeof(pthread_t));
+	for (t = 0; t < dc->jobs; t++) {
+		err = pthread_create(&threads[t], NULL, batch_worker, &job);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(EXIT_TROUBLE);
+		}
+	}
+	for (t = 0; t < dc->jobs; t++)
+		pthread_join(threads[t], NULL);
+	*t_total = now() - t_start;
+	*t_kernel = job.t_kernel;
+
+	for (i = 0; i < job.n; i++) {
+		job.t[i].res.comp_b = 8*job.t[i].res.comp_B;
+		job.t[i].res.flip_01 = job.t[i].res.diff_b -
+		                       job.t[i].res.flip_10;
 	}
-	return sb.st_size;
+	pthread_mutex_destroy(&job.lock);
+	free(threads);
 }
 
-/* Fill buffers. Returns the number of bytes that are ready to be compared
-   in the two buffers. */
-static size_t fill_buffers(const struct diffcount_ctl *dc,
-                           FILE *stream_1, FILE *stream_2,
-			   uint8_t *buf_1, uint8_t *buf_2,
-                           unsigned long long bytes_compared)
+static struct diffcount_res *diffcount(const struct diffcount_ctl *dc)
 {
-	size_t buf_fill, buf1_fill, buf2_fill, read_size;
+	struct diffcount_res *dr;
+	double t_start;
 
-	if ((dc->max_len != 0) && (dc->max_len - bytes_compared) < BUFSIZE) {
-		/* Read size limited by user-specified max_len */
-		read_size = (size_t)(dc->max_len - bytes_compared);
-	} else {
-		/* Try to read the full BUFSIZE */
-		read_size = BUFSIZE;
+	t_start = now();
+	dr = malloc_or_die(sizeof(struct diffcount_res));
+	memset(dr, 0, sizeof(struct diffcount_res));
+	if (dc->window != 0) dr->prof = profile_open(dc);
+	dr->cw_hist = codeword_hist(dc);
+	if (dc->range_fname != NULL) dr->rl = range_open(dc);
+
+	if (dc->sample_B != 0 || dc->sample_err != 0)
+		diffcount_sampled(dc, dr);
+	else if (dc->jobs > 1)
+		diffcount_chunked(dc, dr);
+	else
+		diffcount_range(dc, dc->seek_1, dc->seek_2, dc->max_len, dr);
+
+	if (dr->prof != NULL) {
+		profile_close(dr->prof);
+		dr->prof = NULL;
+	}
+	if (dr->rl != NULL) {
+		dr->n_ranges = range_close(dr->rl);
+		dr->rl = NULL;
 	}
 
-	buf1_fill = fread(buf_1, 1, read_size, stream_1);
+	dr->comp_b = 8*dr->comp_B;
+	if (dc->mask_fname != NULL || dc->mask_pat != NULL)
+		dr->comp_b = dr->mask_b;
+	dr->flip_01 = dr->diff_b - dr->flip_10;
+	/* The input ended inside a codeword */
+	if (dr->cw_hist != NULL && dr->comp_B % (dc->cw_bits/8) != 0)
+		dr->cw_hist[dr->cw_weight]++;
+	dr->t_total = now() - t_start;
 
-	if (dc->cmp_mode == CMP_CONST) {
-		/* In const mode, buffer count is whatever we managed to read
-		   from the first stream */
-		buf_fill = buf1_fill;
-	} else {
-		buf2_fill = fread(buf_2, 1, read_size, stream_2);
-		/* Return the lesser of the number of bytes that we
-		   successfuly read from each of the two streams. */
-		buf_fill = buf1_fill < buf2_fill ? buf1_fill : buf2_fill;
+	return dr;
+}
+
+/* Seed the register from the first bits of file 1. Each of the first
+   LFSR_TRIES runs of n bits is tried as the register, and the seed that
+   leaves the fewest differences over the first LFSR_PROBE bytes is kept,
+   so a bit error early on does not throw the sequence off. */
+static void lfsr_sync(struct diffcount_ctl *dc)
+{
+	const unsigned n = dc->lfsr_len;
+	unsigned long long best_b = ~0ULL, best_t = 0, t, b;
+	uint64_t reg, best = 0;
+	struct diffcount_res r;
+	struct lfsr_gen *g;
+	uint8_t *buf, *probe;
+	size_t got, len, off;
+	unsigned k;
+
+	if (!is_seekable(dc->fname_1)) {
+		fprintf(stderr, "sync needs a seekable file1\n");
+		exit(EXIT_TROUBLE);
+	}
+	buf = align_read(dc->fname_1, dc->seek_1, LFSR_PROBE + 1, &got);
+	probe = buf;
+	len = got;
+	if (dc->bit_1) {
+		len = got > 0 ? got - 1 : 0;
+		probe = malloc_or_die(LFSR_PROBE);
+		dc->kernel->shift_fn(buf, dc->bit_1, len, probe);
+	}
+	if (len > LFSR_PROBE) len = LFSR_PROBE;
+
+	g = lfsr_open(dc);
+	for (k = 0; k < LFSR_TRIES && (k + 1)*n <= 8*len; k++) {
+		/* The register after bits kn to kn + n - 1, wound back to the
+		   start */
+		reg = 0;
+		for (t = k*n; t < (k + 1)*n; t++)
+			reg = reg << 1 |
+			      ((probe[t/8] >> (7 - t % 8) & 1) ^ dc->lfsr_inv);
+		for (t = 0; t < (k + 1)*n; t++)
+			reg = lfsr_back(reg, dc->lfsr_taps, n);
+		/* All zeros locks up */
+		if (reg == 0) continue;
+
+		dc->lfsr_seed = reg;
+		g->valid = 0;
+		r.diff_B = r.diff_b = r.flip_10 = 0;
+		for (off = 0; off < len; off += PATTERN_TILE) {
+			b = len - off < PATTERN_TILE ? len - off : PATTERN_TILE;
+			dc->kernel->fn(probe + off, lfsr_get(g, off, b), b, &r);
+		}
+		if (r.diff_b < best_b) {
+			best_b = r.diff_b;
+			best_t = k*n;
+			best = reg;
+		}
+	}
+	free(g);
+	if (best == 0) {
+		fprintf(stderr, "%s: cannot synchronize the LFSR\n",
+		        dc->fname_1);
+		exit(EXIT_TROUBLE);
 	}
+	dc->lfsr_seed = best;
+	printf("Synchronized on bits %llu to %llu, with %llu of %zu probe "
+	       "bits differing\n\n", best_t, best_t + n - 1, best_b, 8*len);
 
-	return buf_fill;
+	if (probe != buf) free(probe);
+	free(buf);
 }
 
-static struct diffcount_res *diffcount(const struct diffcount_ctl *dc)
+/* Read all of fname into a new buffer. Sets *len to its size. */
+static uint8_t *read_whole(const char *fname, size_t *len)
 {
-	FILE *stream_1 = NULL, *stream_2 = NULL;
-	uint8_t *buf_1, *buf_2, byte_xor;
-	uint64_t quad_xor;
-	unsigned long long buf_idx, buf_fill;
-	struct diffcount_res *dr;
-	/* Better performance using independent local variables. Assigned
-	   to the struct before returning */
-	unsigned long long comp_B = 0, diff_B = 0, diff_b = 0;
+	uint8_t *buf;
+	int fd;
 
-	stream_1 = fopen_and_seek(dc->fname_1, dc->seek_1);
-	if (dc->cmp_mode == CMP_FILE)
-		stream_2 = fopen_and_seek(dc->fname_2, dc->seek_2);
+	*len = get_filesize(fname);
+	buf = malloc_or_die(*len ? *len : 1);
+	fd = open_or_die(fname, O_RDONLY);
+	*len = pread_full(fd, fname, buf, *len, 0);
+	close(fd);
+	return buf;
+}
 
-	buf_1 = malloc_or_die(BUFSIZE);
-	buf_2 = malloc_or_die(BUFSIZE);
+/* Polynomials of the standard PRBS sequences */
+#define POLY(a, b) (1ULL << ((a) - 1) | 1ULL << ((b) - 1))
+static const struct {
+	const char *name;
+	unsigned len;
+	uint64_t taps;
+} prbs_polys[] = {
+	{ "prbs7",   7, POLY(7, 6) },
+	{ "prbs9",   9, POLY(9, 5) },
+	{ "prbs11", 11, POLY(11, 9) },
+	{ "prbs15", 15, POLY(15, 14) },
+	{ "prbs20", 20, POLY(20, 3) },
+	{ "prbs23", 23, POLY(23, 18) },
+	{ "prbs31", 31, POLY(31, 28) },
+	{ NULL, 0, 0 }
+};
 
-	/* Fill buffer 2 with the constant value in constant mode */
-	if (dc->cmp_mode == CMP_CONST) memset(buf_2, dc->const_val, BUFSIZE);
+/* Parse an LFSR reference, prbsN or lfsr:taps, followed by any of ,sync
+   ,inv and ,seed=value. Returns nonzero if valid. */
+static int parse_lfsr(struct diffcount_ctl *dc, const char *str)
+{
+	char *spec, *opt, *end;
+	unsigned i;
+	int ok = 1;
 
-	buf_fill = 0;
-	buf_idx = 0;
-	while(1) {
-		/* Fill up the buffer if we're at the end */
-		if (buf_idx == buf_fill) {
-			/* TODO: Threads for better performance? */
-			buf_fill = fill_buffers(dc, stream_1, stream_2, buf_1,
-			                        buf_2, comp_B);
-
-			/* If buf_fill is zero, we have no new data to compare,
-			   either because we already read up to max_len, or
-			   because we encountered EOF in either or both of
-			   the streams. Either way, we're done.*/
-			if (buf_fill == 0) break;
-			buf_idx = 0;
-		}
-
-		if ((buf_fill - buf_idx) >= 8) {
-			/* Process 8 bytes at a time */
-			quad_xor = *(uint64_t *)(buf_1 + buf_idx) ^
-			           *(uint64_t *)(buf_2 + buf_idx);
-			for (int i = 0; i < 8; i++) {
-				diff_B += (((quad_xor >> (8*i)) & 0xff) != 0);
-			}
-			diff_b += _mm_popcnt_u64(quad_xor);
-			buf_idx += 8;
-			comp_B += 8;
+	spec = strdup(str);
+	if (spec == NULL) {
+		perror("strdup");
+		exit(EXIT_TROUBLE);
+	}
+	opt = strtok(spec, ",");
+	if (strncmp(opt, "lfsr:", 5) == 0) {
+		dc->lfsr_taps = strtoull(opt + 5, &end, 0);
+		ok = *end == '\0' && end != opt + 5 && dc->lfsr_taps != 0;
+	} else {
+		for (i = 0; prbs_polys[i].name != NULL &&
+		     strcmp(opt, prbs_polys[i].name) != 0; i++);
+		dc->lfsr_name = prbs_polys[i].name;
+		dc->lfsr_taps = prbs_polys[i].taps;
+		ok = dc->lfsr_name != NULL;
+	}
+	if (ok) {
+		dc->lfsr_len = 64 - __builtin_clzll(dc->lfsr_taps);
+		ok = dc->lfsr_len <= LFSR_MAX;
+	}
+	dc->lfsr_seed = ~0ULL;
+	while (ok && (opt = strtok(NULL, ",")) != NULL) {
+		if (strcmp(opt, "sync") == 0) {
+			dc->lfsr_sync = 1;
+		} else if (strcmp(opt, "inv") == 0) {
+			dc->lfsr_inv = 1;
+		} else if (strncmp(opt, "seed=", 5) == 0) {
+			dc->lfsr_seed = strtoull(opt + 5, &end, 0);
+			ok = *end == '\0' && end != opt + 5;
 		} else {
-			/* Clean up any remaining bytes */
-			byte_xor = buf_1[buf_idx] ^ buf_2[buf_idx];
-			diff_B += byte_xor != 0;
-			diff_b += _mm_popcnt_u32(byte_xor);
-			buf_idx++;
-			comp_B++;
+			ok = 0;
 		}
 	}
+	free(spec);
+	if (!ok) return 0;
+	/* An all-zero register never leaves zero */
+	dc->lfsr_seed &= (1ULL << dc->lfsr_len) - 1;
+	dc->ref = REF_LFSR;
+	return dc->lfsr_seed != 0;
+}
 
-	fclose(stream_1);
-	if (stream_2 != NULL) fclose(stream_2);
-	free(buf_1);
-	free(buf_2);
+/* Parse the constant-mode reference: a byte value, a pattern of hex bytes
+   as 0x and more than two digits, a pattern read from a file as @file,
+   words holding their index or offset as inc:width or addr:width, or an
+   LFSR sequence. Returns nonzero if valid. */
+static int parse_ref(struct diffcount_ctl *dc, const char *str)
+{
+	unsigned long val;
+	uint8_t *pat;
+	size_t len, i;
+	char *end;
 
-	dr = malloc_or_die(sizeof(struct diffcount_res));
-	dr->comp_B = comp_B;
-	dr->comp_b = 8*comp_B;
-	dr->diff_B = diff_B;
-	dr->diff_b = diff_b;
+	if (strncmp(str, "prbs", 4) == 0 || strncmp(str, "lfsr:", 5) == 0)
+		return parse_lfsr(dc, str);
+	if (strncmp(str, "inc:", 4) == 0 || strncmp(str, "addr:", 5) == 0) {
+		dc->ref = str[0] == 'i' ? REF_COUNT : REF_ADDR;
+		val = strtoul(strchr(str, ':') + 1, &end, 0);
+		dc->ref_width = val;
+		return *end == '\0' &&
+		       (val == 1 || val == 2 || val == 4 || val == 8);
+	}
+	if (str[0] == '@') {
+		pat = read_whole(str + 1, &len);
+	} else if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X') &&
+	           strlen(str) > 4) {
+		pat = parse_hex(str, &len);
+	} else {
+		val = strtoul(str, &end, 0);
+		dc->const_val = val;
+		return *end == '\0' && end != str && val <= 0xff;
+	}
+	if (pat == NULL || len == 0) {
+		free(pat);
+		return 0;
+	}
+	/* A pattern of one repeated byte is just that byte */
+	for (i = 1; i < len && pat[i] == pat[0]; i++);
+	dc->const_val = pat[0];
+	if (i < len) {
+		dc->ref = REF_PATTERN;
+		dc->ref_pat = tile_pattern(pat, len);
+		dc->ref_period = len;
+	}
+	free(pat);
+	return 1;
+}
 
-	return dr;
+/* Print the constant-mode reference */
+static void print_ref(const struct diffcount_ctl *dc)
+{
+	size_t i;
+
+	switch (dc->ref) {
+	case REF_BYTE:
+		printf("Compared to constant value 0x%02hhx\n", dc->const_val);
+		break;
+	case REF_PATTERN:
+		printf("Compared to a %zu-byte pattern 0x", dc->ref_period);
+		for (i = 0; i < dc->ref_period && i < 16; i++)
+			printf("%02hhx", dc->ref_pat[i]);
+		printf("%s\n", dc->ref_period > 16 ? "..." : "");
+		break;
+	case REF_COUNT:
+		printf("Compared to %u-byte words holding their index\n",
+		       dc->ref_width);
+		break;
+	case REF_ADDR:
+		printf("Compared to %u-byte words holding their offset\n",
+		       dc->ref_width);
+		break;
+	case REF_LFSR:
+		if (dc->lfsr_name != NULL)
+			printf("Compared to %s", dc->lfsr_name);
+		else
+			printf("Compared to an LFSR sequence, taps 0x%llx",
+			       (unsigned long long)dc->lfsr_taps);
+		printf(", %s 0x%llx%s\n",
+		       dc->lfsr_sync ? "synchronized to" : "seed",
+		       (unsigned long long)dc->lfsr_seed,
+		       dc->lfsr_inv ? ", inverted" : "");
+		break;
+	}
+}
+
+/* Print the sector sizes of a block device input */
+static void print_sectors(const char *filename)
+{
+	unsigned physical;
+	int logical;
+
+	if (!is_blockdev(filename)) return;
+	get_sectors(filename, &logical, &physical);
+	printf("  Block device, %d byte logical, %u byte physical sectors\n",
+	       logical, physical);
+}
+
+/* Print the differing bits by position in words of dc->lane_width bits,
+   folded from the 64-bit positions */
+static void print_lanes(const struct diffcount_ctl *dc,
+                        const struct diffcount_res *dr)
+{
+	unsigned long long count, comp_B;
+	unsigned p, q, b;
+
+	printf("\nDiffering bits by position in %u-bit words:\n",
+	       dc->lane_width);
+	printf("   Bit       Bit count     Bit fraction\n");
+	for (p = 0; p < dc->lane_width; p++) {
+		count = 0;
+		for (q = p; q < 64; q += dc->lane_width)
+			count += dr->lane_b[q];
+		/* Bytes compared at the byte of the word holding bit p */
+		comp_B = 0;
+		for (b = p/8; b < 8; b += dc->lane_width/8)
+			comp_B += dr->comp_B/8 + (b < dr->comp_B % 8);
+		printf("  %4u  %14llu  %14.13f\n", p, count,
+		       1.0*count/comp_B);
+	}
+}
+
+/* Print the codeword error weight histogram, skipping empty buckets */
+static void print_codewords(const struct diffcount_ctl *dc,
+                            const struct diffcount_res *dr)
+{
+	unsigned long long total = 0, over = 0;
+	unsigned k;
+
+	for (k = 0; k <= dc->cw_bits; k++) {
+		total += dr->cw_hist[k];
+		if ((int)k > dc->cw_t) over += dr->cw_hist[k];
+	}
+
+	printf("\nCodewords of %u bits by differing bits:\n", dc->cw_bits);
+	printf("   Bits       Codewords         Fraction\n");
+	for (k = 0; k <= dc->cw_bits; k++) {
+		if (dr->cw_hist[k] == 0) continue;
+		printf("  %5u  %14llu  %14.13f\n", k, dr->cw_hist[k],
+		       1.0*dr->cw_hist[k]/total);
+	}
+	if (dc->cw_t >= 0)
+		printf("Over %d bits: %14llu  %14.13f\n", dc->cw_t, over,
+		       1.0*over/total);
+}
+
+/* Print the fractions estimated from samples, with their intervals */
+static void print_samples(const struct diffcount_ctl *dc,
+                          const struct diffcount_res *dr)
+{
+	double lo_B, lo_b, hi_B, hi_b;
+
+	lo_B = dr->est_B > dr->err_B ? dr->est_B - dr->err_B : 0;
+	lo_b = dr->est_b > dr->err_b ? dr->est_b - dr->err_b : 0;
+	hi_B = dr->est_B + dr->err_B < 1 ? dr->est_B + dr->err_B : 1;
+	hi_b = dr->est_b + dr->err_b < 1 ? dr->est_b + dr->err_b : 1;
+	/* The interval is empty when no sample differs. By the rule of three,
+	   fewer than 3 in n blocks then likely differ, and no more bytes or
+	   bits than that. */
+	if (dr->diff_B == 0) {
+		hi_B = 3.0/dr->samples < 1 ? 3.0/dr->samples : 1;
+		hi_b = hi_B;
+	}
+
+	printf("\nSampled %llu blocks of %zu bytes from %llu (0x%llx) bytes\n",
+	       dr->samples, dc->bufsize, dr->sample_of, dr->sample_of);
+	printf("Estimated differ fractions, with 95%% interval:\n");
+	printf("  Low:  %14s  %14.13f  %14s  %14.13f\n", "", lo_B, "", lo_b);
+	printf("  Est:  %14s  %14.13f  %14s  %14.13f\n", "",
+	       dr->est_B, "", dr->est_b);
+	printf("  High: %14s  %14.13f  %14s  %14.13f\n", "", hi_B, "", hi_b);
+	if (dr->diff_B == 0)
+		printf("No differences sampled: High bounds the fraction of "
+		       "blocks that differ\n");
 }
 
 static void print_results(const struct diffcount_ctl *dc,
                           const struct diffcount_res *dr)
 {
-	unsigned long long fsize_1, fsize_2;
+	unsigned long long fsize_1, fsize_2 = 0;
 
 	fsize_1 = get_filesize(dc->fname_1);
 
@@ -228,18 +6116,35 @@ static void print_results(const struct diffcount_ctl *dc,
 
 	printf("File 1: %s\n", dc->fname_1);
 	printf("  Size: %llu (0x%llx) bytes\n", fsize_1, fsize_1);
-	printf("  Offset: %llu (0x%llx) bytes\n", dc->seek_1, dc->seek_1);
+	print_sectors(dc->fname_1);
+	printf("  Offset: %llu (0x%llx) bytes", dc->seek_1, dc->seek_1);
+	if (dc->bit_1) printf(" and %u bits", dc->bit_1);
+	printf("\n");
 	if (dc->cmp_mode == CMP_FILE) {
 		printf("File 2: %s\n", dc->fname_2);
 		printf("  Size: %llu (0x%llx) bytes\n", fsize_2, fsize_2);
-		printf("  Offset: %llu (0x%llx) bytes\n",
-		       dc->seek_2, dc->seek_2);
+		print_sectors(dc->fname_2);
+		printf("  Offset: %llu (0x%llx) bytes", dc->seek_2, dc->seek_2);
+		if (dc->bit_2) printf(" and %u bits", dc->bit_2);
+		printf("\n");
 	} else {
-		printf("Compared to constant value 0x%02hhx\n",
-		       dc->const_val);
+		print_ref(dc);
 	}
-	printf("Compared %llu (0x%llx) bytes, %llu (0x%llx) bits\n\n",
+	if (dc->mask_fname != NULL)
+		printf("Masked by: %s\n", dc->mask_fname);
+	if (dc->mask_pat != NULL)
+		printf("Masked by a %zu-byte pattern\n", dc->mask_period);
+	printf("Compared %llu (0x%llx) bytes, %llu (0x%llx) bits\n",
 	       dr->comp_B, dr->comp_B, dr->comp_b, dr->comp_b);
+	if (dc->shared || dc->verbose) {
+		printf("  Resolved from metadata: %llu (0x%llx) bytes\n",
+		       dr->meta_B, dr->meta_B);
+		printf("  Read: %llu (0x%llx) bytes\n",
+		       dr->comp_B - dr->meta_B, dr->comp_B - dr->meta_B);
+	}
+	if (dr->stopped)
+		printf("Stopped early: differences over the limit\n");
+	printf("\n");
 
 	printf("            Byte count    Byte fraction       "
 	       "Bit count     Bit fraction\n");
@@ -247,71 +6152,623 @@ static void print_results(const struct diffcount_ctl *dc,
 	printf("Differ: %14llu  %14.13f  %14llu  %14.13f\n",
 	       dr->diff_B, 1.0*dr->diff_B/dr->comp_B,
 	       dr->diff_b, 1.0*dr->diff_b/dr->comp_b);
+	printf("  0->1: %33s  %14llu  %14.13f\n", "",
+	       dr->flip_01, 1.0*dr->flip_01/dr->comp_b);
+	printf("  1->0: %33s  %14llu  %14.13f\n", "",
+	       dr->flip_10, 1.0*dr->flip_10/dr->comp_b);
 	printf("Equal:  %14llu  %14.13f  %14llu  %14.13f\n",
 	       dr->comp_B - dr->diff_B,
 	       (1.0*dr->comp_B - dr->diff_B)/dr->comp_B,
 	       dr->comp_b - dr->diff_b,
 	       (1.0*dr->comp_b - dr->diff_b)/dr->comp_b);
+
+	if (dr->samples != 0) print_samples(dc, dr);
+	if (dc->range_fname != NULL)
+		printf("Differing ranges: %llu\n", dr->n_ranges);
+	if (dc->lane_width != 0) print_lanes(dc, dr);
+	if (dc->cw_bits != 0) print_codewords(dc, dr);
+
+	if (dc->verbose) {
+		printf("\nEngine: %s, %u thread(s)\n", dc->engine->name,
+		       dc->jobs);
+		printf("Kernel: %s\n", dc->kernel->name);
+		printf("  Total:  %10.3f s  %10.1f MB/s\n", dr->t_total,
+		       dr->comp_B/dr->t_total/1e6);
+		printf("  Kernel: %10.3f s  %10.1f MB/s\n", dr->t_kernel,
+		       dr->comp_B/dr->t_kernel/1e6);
+	}
+}
+
+static void print_vote(const struct diffcount_ctl *dc,
+                       const struct vote_res *vr)
+{
+	unsigned long long fsize, comp_b = 8*vr->comp_B;
+	unsigned f, k;
+
+	for (f = 0; f < dc->nfiles; f++) {
+		fsize = get_filesize(dc->fnames[f]);
+		printf("File %u: %s\n", f + 1, dc->fnames[f]);
+		printf("  Size: %llu (0x%llx) bytes\n", fsize, fsize);
+		print_sectors(dc->fnames[f]);
+	}
+	if (dc->vote_fname != NULL)
+		printf("Majority written to: %s\n", dc->vote_fname);
+	printf("Compared %llu (0x%llx) bytes, %llu (0x%llx) bits\n\n",
+	       vr->comp_B, vr->comp_B, comp_b, comp_b);
+
+	printf("            Byte count    Byte fraction       "
+	       "Bit count     Bit fraction\n");
+	printf("Differ: %14llu  %14.13f  %14llu  %14.13f\n",
+	       vr->any_B, 1.0*vr->any_B/vr->comp_B,
+	       vr->any_b, 1.0*vr->any_b/comp_b);
+	printf("Equal:  %14llu  %14.13f  %14llu  %14.13f\n",
+	       vr->comp_B - vr->any_B,
+	       (1.0*vr->comp_B - vr->any_B)/vr->comp_B,
+	       comp_b - vr->any_b, (1.0*comp_b - vr->any_b)/comp_b);
+
+	printf("\nBits by inputs outvoted:\n");
+	printf(" Inputs       Bit count     Bit fraction\n");
+	for (k = 0; k <= dc->nfiles/2; k++)
+		printf("  %5u  %14llu  %14.13f\n", k, vr->hist[k],
+		       1.0*vr->hist[k]/comp_b);
+
+	printf("\nBits outvoted by input:\n");
+	printf("   File       Bit count     Bit fraction\n");
+	for (f = 0; f < dc->nfiles; f++)
+		printf("  %5u  %14llu  %14.13f\n", f + 1, vr->copy_b[f],
+		       1.0*vr->copy_b[f]/comp_b);
+
+	if (dc->verbose) {
+		printf("\nEngine: %s, %u thread(s)\n", dc->engine->name,
+		       dc->jobs);
+		printf("Kernel: %s\n", dc->kernel->name);
+		printf("  Total:  %10.3f s  %10.1f MB/s\n", vr->t_total,
+		       vr->comp_B/vr->t_total/1e6);
+		printf("  Kernel: %10.3f s  %10.1f MB/s\n", vr->t_kernel,
+		       vr->comp_B/vr->t_kernel/1e6);
+	}
+}
+
+/* Print a CSV row for each target, in list order */
+static void print_batch(const struct diffcount_ctl *dc,
+                        const struct batch_target *t, size_t n,
+                        double t_total, double t_kernel)
+{
+	unsigned long long fsize, total = 0;
+	size_t i, differ = 0;
+
+	for (i = 0; i < n; i++) {
+		if (t[i].res.diff_B != 0) differ++;
+		total += t[i].res.comp_B;
+	}
+
+	fsize = get_filesize(dc->fname_1);
+	printf("File 1: %s\n", dc->fname_1);
+	printf("  Size: %llu (0x%llx) bytes\n", fsize, fsize);
+	print_sectors(dc->fname_1);
+	printf("  Offset: %llu (0x%llx) bytes\n", dc->seek_1, dc->seek_1);
+	printf("Targets: %zu from %s, %zu differing\n\n", n, dc->batch_fname,
+	       differ);
+
+	printf("target,offset,compared_bytes,differ_bytes,differ_bits,"
+	       "flip_01,flip_10\n");
+	for (i = 0; i < n; i++)
+		printf("%s,%llu,%llu,%llu,%llu,%llu,%llu\n", t[i].fname,
+		       t[i].seek, t[i].res.comp_B, t[i].res.diff_B,
+		       t[i].res.diff_b, t[i].res.flip_01, t[i].res.flip_10);
+
+	if (dc->verbose) {
+		printf("\nEngine: %s, %u thread(s)\n", dc->engine->name,
+		       dc->jobs);
+		printf("Kernel: %s\n", dc->kernel->name);
+		printf("  Total:  %10.3f s  %10.1f MB/s\n", t_total,
+		       total/t_total/1e6);
+		printf("  Kernel: %10.3f s  %10.1f MB/s\n", t_kernel,
+		       total/t_kernel/1e6);
+	}
 }
 
 static void show_help(char **argv, int verbose)
 {
-	printf("Usage: %s [-ch] [-n len] file1 file2/const [seek1 [seek2]]\n",
-	       argv[0]);
+	const struct diff_kernel *k;
+
+	printf("Usage: %s [-cDhNrSvx] [-a size] [-A lags] [-b size] "
+	       "[-e engine] "
+	       "[-E bits[,t]] [-g gap] [-j jobs] [-k kernel] [-l file] "
+	       "[-L bits] [-m file | -M hex] [-n len] [-o file | -O file] "
+	       "[-P size] "
+	       "[-q depth] "
+	       "[-s size] [-t limit] [-T limit] [-V file] [-w size] "
+	       "file1 file2/ref [seek1 [seek2]]\n", argv[0]);
+	printf("       %s -N [-V file] [-b size] [-D] [-e engine] [-j jobs] "
+	       "[-k kernel] [-n len]\n"
+	       "       [-q depth] [-v] file1 file2 [file3 ...]\n", argv[0]);
+	printf("       %s -B list [-b size] [-D] [-e engine] [-j jobs] "
+	       "[-k kernel] [-n len]\n"
+	       "       [-q depth] [-v] file1 [seek1 [seek2]]\n", argv[0]);
 	if (verbose) {
-		printf(" -c       compare file to constant byte value\n"
+		printf(" -a size  block device readahead during the compare\n"
+		       " -A lags  compare at the best lag of file 2 against "
+		       "file 1, from -lags to\n"
+		       "          lags, or in min:max\n"
+		       " -b size  read buffer size (default: %d)\n"
+		       " -B list  compare file1 against each target in list, "
+		       "a path and an\n"
+		       "          optional offset per line, - for stdin\n"
+		       " -c       compare file to a reference: a byte value, "
+		       "0x and a hex byte\n"
+		       "          pattern, @file for a pattern file, or "
+		       "inc:width or addr:width\n"
+		       "          for words holding their index or offset, "
+		       "or prbsN or\n"
+		       "          lfsr:taps with ,sync ,inv or ,seed=value\n"
+		       " -D       bypass the page cache with direct I/O\n"
+		       " -e name  input engine: auto, mmap, pread, stdio or "
+		       "uring (default: auto)\n"
+		       " -E bits[,t] count codewords of bits, a multiple of 64, "
+		       "by differing bits,\n"
+		       "          and those with more than t\n"
+		       " -g gap   merge -l ranges no more than gap bytes apart\n"
 		       " -h       print help\n"
-		       " -n len   maximum number of bytes to compare\n");
+		       " -j jobs  number of compare threads (default: 1)\n"
+		       " -k name  compare kernel (default: auto)\n"
+		       " -l file  list differing byte ranges as CSV, - for stdout\n"
+		       " -L bits  count differing bits by position in 8, 16, "
+		       "32 or 64-bit words\n"
+		       " -m file  compare only the bits set in file, read at "
+		       "the offsets of file1\n"
+		       " -M hex   compare only the bits set in a repeating "
+		       "pattern of hex bytes\n"
+		       " -n len   maximum number of bytes to compare\n"
+		       " -N       compare up to %d files bit by bit, against "
+		       "their majority\n"
+		       " -o file  write the -w profile as CSV, - for stdout\n"
+		       " -O file  write the -w profile as binary records\n"
+		       " -r       take ranges sharing physical extents "
+		       "(reflinks) as equal\n"
+		       " -s size  estimate the differences from a sample of "
+		       "size bytes, or below 1,\n"
+		       "          until the 95%% intervals are that narrow\n"
+		       " -S       read holes in sparse files instead of "
+		       "skipping them\n"
+		       " -P size  bytes of file 1 to score -A lags on "
+		       "(default: %d)\n"
+		       " -q depth read buffer pairs in flight; 1 reads on the "
+		       "compare thread\n"
+		       "          (default: %d, or 1 with -j)\n"
+		       " -t limit stop once more bits than limit differ; a "
+		       "limit below 1 is a\n"
+		       "          fraction of the bits to compare\n"
+		       " -T limit as -t, for differing bytes\n"
+		       " -v       report kernel and throughput\n"
+		       " -V file  write the majority of the -N files to file\n"
+		       " -w size  profile the differences in windows of "
+		       "size bytes\n"
+		       " -x       stop at the first difference; inputs of "
+		       "different sizes differ\n"
+		       "Exit status is 0 with no differences, or none over "
+		       "the -t and -T limits,\n"
+		       "1 otherwise, and 2 on errors.\n",
+		       BUFSIZE, VOTE_MAX, ALIGN_PROBE, RING_DEPTH);
+		printf("Kernels:");
+		for (k = diff_kernels; k->name != NULL; k++)
+			printf(" %s%s", k->name,
+			       k->supported() ? "" : "(unsupported)");
+		printf("\n");
 	}
-	exit(EXIT_FAILURE);
+	exit(EXIT_TROUBLE);
 }
 
 int main(int argc, char **argv) 
 {
 	int opt;
+	char *end;
+	unsigned long long len_1, len_2;
+	double frac_B = 0, frac_b = 0;
+	uint8_t *mask_pat = NULL;
+	int status, nway = 0;
+	const char *kernel_name = "auto";
+	const char *engine_name = "auto";
 
 	struct diffcount_ctl *dc;
 	struct diffcount_res *dr;
+	struct vote_res *vr;
+	struct batch_target *bt;
+	double t_total, t_kernel;
+	size_t nt, i;
+	unsigned f;
 
 	dc = diffcount_ctl_init();
 
 	/* Get command line arguments */
-	while ((opt = getopt(argc, argv, "chn:")) != -1) {
+	while ((opt = getopt(argc, argv, "a:A:b:B:cDe:E:g:hj:k:l:L:m:M:n:N"
+	                                 "o:O:P:q:rs:St:T:vV:w:x")) != -1) {
 		switch (opt) {
+		case 'a':
+			dc->readahead = parse_size(optarg);
+			break;
+		case 'A':
+			dc->lag_search = 1;
+			dc->lag_max = strtoll(optarg, &end, 0);
+			dc->lag_min = -dc->lag_max;
+			if (*end == ':') {
+				dc->lag_min = dc->lag_max;
+				dc->lag_max = strtoll(end + 1, &end, 0);
+			}
+			if (*end != '\0' || dc->lag_min > dc->lag_max)
+				show_help(argv, 0);
+			break;
+		case 'b':
+			dc->bufsize = parse_size(optarg);
+			if (dc->bufsize == 0) show_help(argv, 0);
+			break;
+		case 'B':
+			dc->batch_fname = optarg;
+			break;
 		case 'c':
 			dc->cmp_mode = CMP_CONST;
 			break;
+		case 'D':
+			dc->direct = 1;
+			break;
+		case 'e':
+			engine_name = optarg;
+			break;
+		case 'E':
+			dc->cw_bits = strtoul(optarg, &end, 0);
+			if (*end == ',') dc->cw_t = strtol(end + 1, &end, 0);
+			if (dc->cw_bits == 0 || dc->cw_bits % 64 != 0 ||
+			    *end != '\0' || dc->cw_t < -1)
+				show_help(argv, 0);
+			break;
+		case 'g':
+			dc->range_gap = parse_size(optarg);
+			break;
 		case 'h':
 			show_help(argv, 1);
 			break;
+		case 'j':
+			dc->jobs = strtoul(optarg, NULL, 0);
+			if (dc->jobs == 0) show_help(argv, 0);
+			break;
+		case 'k':
+			kernel_name = optarg;
+			break;
+		case 'l':
+			dc->range_fname = optarg;
+			break;
+		case 'L':
+			dc->lane_width = strtoul(optarg, NULL, 0);
+			if (dc->lane_width != 8 && dc->lane_width != 16 &&
+			    dc->lane_width != 32 && dc->lane_width != 64)
+				show_help(argv, 0);
+			break;
+		case 'm':
+			dc->mask_fname = optarg;
+			break;
+		case 'M':
+			free(mask_pat);
+			mask_pat = parse_hex(optarg, &dc->mask_period);
+			if (mask_pat == NULL) show_help(argv, 0);
+			break;
 		case 'n':
-			dc->max_len = strtoull(optarg, NULL, 0);
+			dc->max_len = parse_size(optarg);
+			break;
+		case 'N':
+			nway = 1;
+			break;
+		case 'o':
+		case 'O':
+			dc->prof_fname = optarg;
+			dc->prof_binary = opt == 'O';
+			break;
+		case 'P':
+			dc->probe = parse_size(optarg);
+			if (dc->probe == 0) show_help(argv, 0);
+			break;
+		case 'q':
+			dc->ring_depth = strtoul(optarg, NULL, 0);
+			if (dc->ring_depth == 0) show_help(argv, 0);
+			break;
+		case 'r':
+			dc->shared = 1;
+			break;
+		case 's':
+			parse_limit(optarg, &dc->sample_B, &dc->sample_err);
+			if (dc->sample_B == 0 && dc->sample_err == 0)
+				show_help(argv, 0);
+			break;
+		case 'S':
+			dc->sparse = 0;
+			break;
+		case 't':
+			parse_limit(optarg, &dc->limit_b, &frac_b);
+			break;
+		case 'T':
+			parse_limit(optarg, &dc->limit_B, &frac_B);
+			break;
+		case 'v':
+			dc->verbose = 1;
+			break;
+		case 'V':
+			dc->vote_fname = optarg;
+			nway = 1;
+			break;
+		case 'w':
+			dc->window = parse_size(optarg);
+			if (dc->window == 0) show_help(argv, 0);
+			break;
+		case 'x':
+			dc->limit_B = 0;
+			dc->size_differ = 1;
 			break;
 		default:
 			show_help(argv, 0);
 		}
 	}
 
+	if (nway && dc->batch_fname != NULL) {
+		fprintf(stderr, "-B cannot be combined with -N or -V\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	/* N-way comparisons take every argument as an input and none of the
+	   options that follow a single pair of files */
+	if (nway) {
+		if (argc - optind < 2 || argc - optind > VOTE_MAX)
+			show_help(argv, 0);
+		if (dc->cmp_mode == CMP_CONST || dc->lag_search ||
+		    dc->cw_bits != 0 || dc->range_fname != NULL ||
+		    dc->lane_width != 0 || dc->mask_fname != NULL ||
+		    mask_pat != NULL || dc->window != 0 ||
+		    dc->prof_fname != NULL || dc->shared ||
+		    dc->sample_B != 0 || dc->sample_err != 0 ||
+		    dc->limit_B != NO_LIMIT || dc->limit_b != NO_LIMIT ||
+		    frac_B != 0 || frac_b != 0 || dc->size_differ) {
+			fprintf(stderr, "-N cannot be combined with -A, -c, "
+			        "-E, -l, -L, -m, -M, -o, -O, -r, -s, -t, -T, "
+			        "-w or -x\n");
+			exit(EXIT_TROUBLE);
+		}
+		dc->fnames = argv + optind;
+		dc->nfiles = argc - optind;
+		dc->fname_1 = dc->fnames[0];
+		dc->fname_2 = dc->fnames[1];
+		dc->sparse = 0;
+		dc->kernel = select_kernel(kernel_name);
+		for (f = 0; f < dc->nfiles; f++)
+			fit_blockdev(dc, dc->fnames[f]);
+		if (dc->ring_depth == 0)
+			dc->ring_depth = dc->jobs > 1 ? 1 : RING_DEPTH;
+		dc->engine = select_engine(dc, engine_name);
+
+		for (f = 0; f < dc->nfiles; f++)
+			apply_readahead(dc, dc->fnames[f]);
+		vr = diffcount_vote(dc);
+		restore_readahead();
+		print_vote(dc, vr);
+		status = vr->any_B != 0 ? EXIT_DIFFER : EXIT_SUCCESS;
+		free(dc);
+		free(vr);
+		return status;
+	}
+
+	/* Batch comparisons take file1 and its offset, and the targets from
+	   the list, and only count differences */
+	if (dc->batch_fname != NULL) {
+		if (argc - optind < 1 || argc - optind > 3)
+			show_help(argv, 0);
+		if (dc->cmp_mode == CMP_CONST || dc->lag_search ||
+		    dc->cw_bits != 0 || dc->range_fname != NULL ||
+		    dc->lane_width != 0 || dc->mask_fname != NULL ||
+		    mask_pat != NULL || dc->window != 0 ||
+		    dc->prof_fname != NULL || dc->shared ||
+		    dc->sample_B != 0 || dc->sample_err != 0 ||
+		    dc->limit_B != NO_LIMIT || dc->limit_b != NO_LIMIT ||
+		    frac_B != 0 || frac_b != 0 || dc->size_differ) {
+			fprintf(stderr, "-B cannot be combined with -A, -c, "
+			        "-E, -l, -L, -m, -M, -o, -O, -r, -s, -t, -T, "
+			        "-w or -x\n");
+			exit(EXIT_TROUBLE);
+		}
+		dc->fname_1 = argv[optind++];
+		if (optind < argc &&
+		    (!parse_seek(argv[optind++], &dc->seek_1, &dc->bit_1) ||
+		     dc->bit_1 != 0))
+			show_help(argv, 0);
+		if (optind < argc &&
+		    (!parse_seek(argv[optind++], &dc->seek_2, &dc->bit_2) ||
+		     dc->bit_2 != 0))
+			show_help(argv, 0);
+		/* Engines are picked for file1 against itself, and per
+		   target as they are opened */
+		dc->fname_2 = dc->fname_1;
+		dc->sparse = 0;
+		dc->kernel = select_kernel(kernel_name);
+		bt = batch_read(dc, &nt);
+		fit_blockdev(dc, dc->fname_1);
+		for (i = 0; i < nt; i++)
+			fit_blockdev(dc, bt[i].fname);
+		if (dc->ring_depth == 0)
+			dc->ring_depth = dc->jobs > 1 ? 1 : RING_DEPTH;
+		dc->engine = select_engine(dc, engine_name);
+
+		apply_readahead(dc, dc->fname_1);
+		diffcount_batch(dc, bt, nt, &t_total, &t_kernel);
+		restore_readahead();
+		print_batch(dc, bt, nt, t_total, t_kernel);
+
+		status = EXIT_SUCCESS;
+		for (i = 0; i < nt; i++) {
+			if (bt[i].res.diff_B != 0) status = EXIT_DIFFER;
+			free(bt[i].fname);
+		}
+		free(bt);
+		free(dc);
+		return status;
+	}
+
 	if ((argc - optind) < 2) show_help(argv, 0);
 	dc->fname_1 = argv[optind++];
 
-	if (dc->cmp_mode == CMP_CONST)
-		dc->const_val = strtoul(argv[optind++], NULL, 0);
-	else
+	if (dc->cmp_mode == CMP_CONST) {
+		if (!parse_ref(dc, argv[optind++])) show_help(argv, 0);
+	} else
 		dc->fname_2 = argv[optind++];
 
-	dc->seek_1 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
-	dc->seek_2 = (optind < argc) ? strtoull(argv[optind++], NULL, 0) : 0;
+	if (optind < argc &&
+	    !parse_seek(argv[optind++], &dc->seek_1, &dc->bit_1))
+		show_help(argv, 0);
+	if (optind < argc &&
+	    !parse_seek(argv[optind++], &dc->seek_2, &dc->bit_2))
+		show_help(argv, 0);
+	if (dc->cmp_mode == CMP_CONST) dc->bit_2 = 0;
 
 	if (optind < argc) show_help(argv, 0); //Leftover arguments
 
+	/* Ranges are written in order as they are found */
+	if (dc->range_fname != NULL && dc->jobs > 1) {
+		fprintf(stderr, "-l needs a single compare thread\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	/* Samples are compared out of order and stand for the whole range */
+	if ((dc->sample_B != 0 || dc->sample_err != 0) &&
+	    (dc->window != 0 || dc->range_fname != NULL || dc->cw_bits != 0 ||
+	     dc->limit_B != NO_LIMIT || dc->limit_b != NO_LIMIT ||
+	     frac_B != 0 || frac_b != 0)) {
+		fprintf(stderr, "-s cannot be combined with -E, -l, -t, -T, "
+		        "-w or -x\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	if (dc->mask_fname != NULL || mask_pat != NULL) {
+		if (dc->mask_fname != NULL && mask_pat != NULL) {
+			fprintf(stderr, "-m and -M cannot be combined\n");
+			exit(EXIT_TROUBLE);
+		}
+		if (dc->cw_bits != 0 || dc->range_fname != NULL ||
+		    dc->lane_width != 0 || dc->sample_B != 0 ||
+		    dc->sample_err != 0 || dc->shared) {
+			fprintf(stderr, "-m and -M cannot be combined with -E, "
+			        "-l, -L, -r or -s\n");
+			exit(EXIT_TROUBLE);
+		}
+		/* The mask has to be read where holes would be skipped */
+		dc->sparse = 0;
+	}
+	/* Holes would be compared against a single byte */
+	if (dc->ref != REF_BYTE) dc->sparse = 0;
+
+	if (dc->mask_fname != NULL && !known_size(dc->mask_fname)) {
+		fprintf(stderr, "-m needs a regular file or block device\n");
+		exit(EXIT_TROUBLE);
+	}
+	if (mask_pat != NULL) {
+		dc->mask_pat = tile_pattern(mask_pat, dc->mask_period);
+		free(mask_pat);
+	}
+
+	if ((dc->window != 0) != (dc->prof_fname != NULL)) {
+		fprintf(stderr, "-w needs -o or -O, and they need -w\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	/* Holes and extents can only be found in regular files */
+	if (!is_regular(dc->fname_1) ||
+	    (dc->cmp_mode == CMP_FILE && !is_regular(dc->fname_2))) {
+		if (dc->shared) {
+			fprintf(stderr, "-r needs regular files\n");
+			exit(EXIT_TROUBLE);
+		}
+		dc->sparse = 0;
+	}
+
+	if (dc->lag_search && dc->cmp_mode == CMP_CONST) {
+		fprintf(stderr, "-A needs two files\n");
+		exit(EXIT_TROUBLE);
+	}
+
+	/* Holes and extents start and end on byte boundaries */
+	if (dc->bit_1 || dc->bit_2) {
+		if (dc->shared || dc->lag_search) {
+			fprintf(stderr, "-A and -r need byte offsets\n");
+			exit(EXIT_TROUBLE);
+		}
+		dc->sparse = 0;
+	}
+	dc->kernel = select_kernel(kernel_name);
+
+	/* Everything else runs at the lag found */
+	if (dc->lag_search) align_search(dc);
+	if (dc->lfsr_sync) lfsr_sync(dc);
+
+	/* Fractional limits scale with the length to compare, which needs
+	   inputs of known size */
+	if (frac_B != 0 || frac_b != 0) {
+		if (!known_size(dc->fname_1) ||
+		    (dc->cmp_mode == CMP_FILE && !known_size(dc->fname_2))) {
+			fprintf(stderr, "-t and -T fractions need inputs of "
+			        "known size\n");
+			exit(EXIT_TROUBLE);
+		}
+		len_1 = compare_len(dc, dc->seek_1, dc->seek_2, dc->max_len);
+		if (frac_B != 0) dc->limit_B = frac_B*len_1;
+		if (frac_b != 0) dc->limit_b = frac_b*8*len_1;
+	}
+
+	/* With -x, inputs of known and different sizes differ without
+	   reading either */
+	if (dc->size_differ && dc->cmp_mode == CMP_FILE &&
+	    known_size(dc->fname_1) && known_size(dc->fname_2)) {
+		len_1 = get_filesize(dc->fname_1);
+		len_1 = len_1 > dc->seek_1 ? len_1 - dc->seek_1 : 0;
+		len_2 = get_filesize(dc->fname_2);
+		len_2 = len_2 > dc->seek_2 ? len_2 - dc->seek_2 : 0;
+		/* In whole realigned bytes */
+		if (dc->bit_1 && len_1 != 0) len_1--;
+		if (dc->bit_2 && len_2 != 0) len_2--;
+		if (dc->max_len != 0 && dc->max_len < len_1)
+			len_1 = dc->max_len;
+		if (dc->max_len != 0 && dc->max_len < len_2)
+			len_2 = dc->max_len;
+		if (len_1 != len_2) {
+			printf("Sizes differ: %llu and %llu bytes from the "
+			       "offsets\n", len_1, len_2);
+			exit(EXIT_DIFFER);
+		}
+	}
+
+	fit_blockdev(dc, dc->fname_1);
+	if (dc->cmp_mode == CMP_FILE) fit_blockdev(dc, dc->fname_2);
+
+	/* Compare threads already keep several reads in flight */
+	if (dc->ring_depth == 0) dc->ring_depth = dc->jobs > 1 ? 1 : RING_DEPTH;
+
+	dc->engine = select_engine(dc, engine_name);
+
+	apply_readahead(dc, dc->fname_1);
+	if (dc->cmp_mode == CMP_FILE) apply_readahead(dc, dc->fname_2);
+
 	/* Perform calculations and print results */
 	dr = diffcount(dc);
+
+	restore_readahead();
+
 	print_results(dc, dr);
 
+	/* Without a limit, any difference counts */
+	if (dc->limit_B == NO_LIMIT && dc->limit_b == NO_LIMIT)
+		status = dr->diff_B != 0 ? EXIT_DIFFER : EXIT_SUCCESS;
+	else
+		status = over_limit(dc, dr) ? EXIT_DIFFER : EXIT_SUCCESS;
+
+	free((uint8_t *)dc->mask_pat);
+	free((uint8_t *)dc->ref_pat);
 	free(dc);
+	free(dr->cw_hist);
 	free(dr);
 
-	return 0;
+	return status;
 }
 